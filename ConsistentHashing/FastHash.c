@@ -0,0 +1,114 @@
+#include <string.h>
+
+#include "FastHash.h"
+
+static const uint64_t wySecret[4] = {
+	0x2d358dccaa6c78a5ULL,
+	0x8bb84b93962eacc9ULL,
+	0x4b33a62ed433d4a3ULL,
+	0x4d5a2da51de1aa47ULL
+};
+
+static inline void
+wyMum(uint64_t *a, uint64_t *b)
+{
+	__uint128_t r = (__uint128_t)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t
+wyMix(uint64_t a, uint64_t b)
+{
+	wyMum(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t
+wyRead8(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+wyRead4(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+wyRead3(const uint8_t *p, uint64_t k)
+{
+	return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t
+wyHashSeed(void *key, uint64_t len, uint64_t seed)
+{
+	const uint8_t *p = key;
+	uint64_t a, b;
+
+	seed ^= wyMix(seed ^ wySecret[0], wySecret[1]);
+
+	if (len <= 16) {
+		if (len >= 4) {
+			a = (wyRead4(p) << 32) | wyRead4(p + ((len >> 3) << 2));
+			b = (wyRead4(p + len - 4) << 32) | wyRead4(p + len - 4 - ((len >> 3) << 2));
+		} else if (len > 0) {
+			a = wyRead3(p, len);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		uint64_t i = len;
+		if (i >= 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = wyMix(wyRead8(p) ^ wySecret[1], wyRead8(p + 8) ^ seed);
+				see1 = wyMix(wyRead8(p + 16) ^ wySecret[2], wyRead8(p + 24) ^ see1);
+				see2 = wyMix(wyRead8(p + 32) ^ wySecret[3], wyRead8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i >= 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = wyMix(wyRead8(p) ^ wySecret[1], wyRead8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = wyRead8(p + i - 16);
+		b = wyRead8(p + i - 8);
+	}
+
+	a ^= wySecret[1];
+	b ^= seed;
+	wyMum(&a, &b);
+
+	return wyMix(a ^ wySecret[0] ^ len, b ^ wySecret[1]);
+}
+
+uint64_t
+wyHash(void *key, uint64_t len)
+{
+	return wyHashSeed(key, len, 0);
+}
+
+uint64_t
+mixHash(uint64_t x)
+{
+	/*
+	 * splitmix64 finalizer.
+	 */
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
@@ -0,0 +1,23 @@
+#ifndef __FAST_HASH_H
+#define __FAST_HASH_H
+
+#include <inttypes.h>
+
+/*
+ * Built-in 64-bit hash functions that can be passed to circleAlloc().
+ */
+
+/*
+ * wyhash (final version 4). Very fast on short keys: keys up to 16 bytes
+ * are hashed with a few unaligned loads and two 64x64->128 bit multiplies.
+ */
+uint64_t wyHash(void *key, uint64_t len);
+uint64_t wyHashSeed(void *key, uint64_t len, uint64_t seed);
+
+/*
+ * Mix a 64-bit value into a well distributed 64-bit hash. This is a
+ * bijection, so distinct inputs never collide.
+ */
+uint64_t mixHash(uint64_t x);
+
+#endif /* __FAST_HASH_H */
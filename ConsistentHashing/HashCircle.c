@@ -1,10 +1,11 @@
-#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <math.h>
 
 #include "HashCircle.h"
+#include "FastHash.h"
 
 Circle *
 circleAlloc(hashFunction hashFunc)
@@ -17,121 +18,1208 @@ circleAlloc(hashFunction hashFunc)
 		return NULL;
 	}
 
-	c->hashFunc = hashFunc;
+	c->hashFunc = hashFunc ? hashFunc : wyHash;
 
 	return c;
 }
 
-static uint64_t
-indexOfClosestPoint(Circle *c, uint64_t hash, int *exactMatch)
+/*
+ * Make room in the lookup index for 'numPoints' points.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and the index is left unchanged.
+ */
+static int
+reserveIndex(Circle *c, uint64_t numPoints)
 {
-	if (exactMatch) {
-		*exactMatch = 0;
+	uint64_t *hashes = realloc(c->hashes, numPoints * sizeof(*hashes));
+	if (hashes == NULL) {
+		fprintf(stderr, "Can't alloc hash index: %s\n", strerror(errno));
+		return -1;
 	}
+	c->hashes = hashes;
 
-	if (c->numPoints <= 0) {
-		return 0;
+	uint64_t *nextDistinct = realloc(c->nextDistinct, numPoints * sizeof(*nextDistinct));
+	if (nextDistinct == NULL) {
+		fprintf(stderr, "Can't alloc successor index: %s\n", strerror(errno));
+		return -1;
 	}
+	c->nextDistinct = nextDistinct;
 
-	uint64_t min = 0;
-	uint64_t max = c->numPoints;
+	if (c->replicaDepth > 0) {
+		Node **replicas = realloc(c->replicas, numPoints * c->replicaDepth * sizeof(*replicas));
+		if (replicas == NULL) {
+			fprintf(stderr, "Can't alloc replica index: %s\n", strerror(errno));
+			return -1;
+		}
+		c->replicas = replicas;
+	}
 
-	while (min < max) {
-		uint64_t middle = min + (max - min) / 2;
+	return 0;
+}
 
-		if (c->points[middle].hash < hash) {
-			min = middle + 1;
-		} else if (c->points[middle].hash > hash) {
-			max = middle;
-		} else {
-			if (exactMatch) {
-				*exactMatch = 1;
+/*
+ * Fill the replica index. A point's list is its own node followed by the
+ * list of the next point of a different node, minus its own node. Like
+ * nextDistinct, the circle is walked backwards twice so the lists of
+ * points near the end see the ones they wrap around to.
+ */
+static void
+indexReplicas(Circle *c)
+{
+	if (c->replicas == NULL) {
+		return;
+	}
+
+	int depth = c->replicaDepth;
+	uint64_t i, k;
+
+	for (i = 0; i < c->numPoints; i++) {
+		Node **list = c->replicas + i * depth;
+		list[0] = c->points[i].node;
+		for (k = 1; k < depth; k++) {
+			list[k] = NULL;
+		}
+	}
+
+	for (k = 2 * c->numPoints; k-- > 0; ) {
+		i = k % c->numPoints;
+		uint64_t j = c->nextDistinct[i];
+		if (c->points[j].node == c->points[i].node) {
+			continue;
+		}
+
+		Node **list = c->replicas + i * depth;
+		Node **next = c->replicas + j * depth;
+		int from, to = 1;
+		for (from = 0; from < depth && to < depth && next[from]; from++) {
+			if (next[from] != list[0]) {
+				list[to++] = next[from];
 			}
-			return middle;
 		}
+		for (; to < depth; to++) {
+			list[to] = NULL;
+		}
+	}
+}
+
+/*
+ * Fill the prefix table: prefix[b] is the index of the first point whose
+ * top 'prefixBits' bits are >= b.
+ */
+static void
+indexPrefixes(Circle *c)
+{
+	if (c->prefix == NULL) {
+		return;
+	}
+
+	uint64_t numBuckets = 1ULL << c->prefixBits;
+	int shift = 64 - c->prefixBits;
+	uint64_t b, i = 0;
+
+	for (b = 0; b < numBuckets; b++) {
+		while (i < c->numPoints && (c->points[i].hash >> shift) < b) {
+			i++;
+		}
+		c->prefix[b] = i;
+	}
+	c->prefix[numBuckets] = c->numPoints;
+}
+
+/*
+ * Rebuild the lookup index after the points array has changed.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned.
+ */
+static int
+indexPoints(Circle *c)
+{
+	uint64_t i, k;
+
+	if (c->numPoints == 0) {
+		free(c->hashes);
+		c->hashes = NULL;
+		free(c->nextDistinct);
+		c->nextDistinct = NULL;
+		free(c->replicas);
+		c->replicas = NULL;
+		indexPrefixes(c);
+		return 0;
+	}
+
+	if (reserveIndex(c, c->numPoints) < 0) {
+		return -1;
+	}
+
+	for (i = 0; i < c->numPoints; i++) {
+		c->hashes[i] = c->points[i].hash;
+		c->nextDistinct[i] = i;
+	}
 
-		if (middle == min) {
-			return middle;
+	/*
+	 * Walk the circle backwards twice so runs of points that wrap around
+	 * the end of the array also see the node that follows them.
+	 */
+	for (k = 2 * c->numPoints - 1; k-- > 0; ) {
+		i = k % c->numPoints;
+		uint64_t j = (k + 1) % c->numPoints;
+		if (c->points[j].node != c->points[i].node) {
+			c->nextDistinct[i] = j;
+		} else {
+			c->nextDistinct[i] = c->nextDistinct[j];
 		}
 	}
 
-	return min;
+	indexPrefixes(c);
+	indexReplicas(c);
+
+	return 0;
 }
 
-Node *
-circleInsert(Circle *c, char *name, void *data, int weight)
+uint64_t
+circleSearch(const uint64_t *hashes, uint64_t numHashes, uint64_t hash)
 {
+	const uint64_t *base = hashes;
+	uint64_t len = numHashes;
+
+	if (len == 0) {
+		return 0;
+	}
+
 	/*
-	 * Create a new node.
+	 * The loop has no data dependent branches: every search does the same
+	 * log2(numHashes) probes. The step is computed with a mask rather than
+	 * a ternary, which GCC would otherwise compile to a jump that random
+	 * keys mispredict half the time. Both possible next probes are
+	 * prefetched while the current one is compared.
 	 */
+	while (len > 1) {
+		uint64_t half = len / 2;
+		uint64_t next = (len - half) / 2;
+
+		__builtin_prefetch(base + next);
+		__builtin_prefetch(base + half + next);
+
+		base += half & -(uint64_t)(base[half - 1] < hash);
+		len -= half;
+	}
+
+	return (base - hashes) + (*base < hash);
+}
+
+/*
+ * Find the index of the first point whose hash is >= 'hash', or numPoints
+ * if there is none. Only the dense hashes array is touched, and with a
+ * prefix table only the few hashes in the key's bucket are searched.
+ */
+static inline uint64_t
+indexOfClosestPoint(Circle *c, uint64_t hash)
+{
+	if (c->prefix) {
+		uint64_t b = hash >> (64 - c->prefixBits);
+		uint64_t lo = c->prefix[b];
+		return lo + circleSearch(c->hashes + lo, c->prefix[b + 1] - lo, hash);
+	}
+	return circleSearch(c->hashes, c->numPoints, hash);
+}
+
+int
+circleSetPrefixBits(Circle *c, int bits)
+{
+	if (bits < 0 || bits > CIRCLE_MAX_PREFIX_BITS) {
+		fprintf(stderr, "%s(%p, %d): Invalid arguments?!\n", __func__, c, bits);
+		return -1;
+	}
+
+	uint64_t *prefix = NULL;
+	if (bits > 0) {
+		prefix = malloc(((1ULL << bits) + 1) * sizeof(*prefix));
+		if (prefix == NULL) {
+			fprintf(stderr, "Can't alloc prefix table: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	free(c->prefix);
+	c->prefix = prefix;
+	c->prefixBits = bits;
+	indexPrefixes(c);
+
+	return 0;
+}
+
+int
+circleSetReplicaDepth(Circle *c, int depth)
+{
+	if (depth < 0) {
+		fprintf(stderr, "%s(%p, %d): Invalid arguments?!\n", __func__, c, depth);
+		return -1;
+	}
+
+	Node **replicas = NULL;
+	if (depth > 0 && c->numPoints > 0) {
+		replicas = malloc(c->numPoints * depth * sizeof(*replicas));
+		if (replicas == NULL) {
+			fprintf(stderr, "Can't alloc replica index: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	free(c->replicas);
+	c->replicas = replicas;
+	c->replicaDepth = depth;
+	indexReplicas(c);
+
+	return 0;
+}
+
+void
+circleFree(Circle **c)
+{
+	if (c == NULL || *c == NULL) {
+		return;
+	}
+
+	Node *n = (*c)->nodes;
+	while (n) {
+		Node *next = n->next;
+		free(n);
+		n = next;
+	}
+
+	free((*c)->points);
+	free((*c)->hashes);
+	free((*c)->nextDistinct);
+	free((*c)->replicas);
+	free((*c)->prefix);
+	free(*c);
+	*c = NULL;
+}
+
+typedef struct NodeMap {
+	Node *from;
+	Node *to;
+} NodeMap;
+
+static int
+nodeMapCompare(const void *a, const void *b)
+{
+	const NodeMap *ma = a;
+	const NodeMap *mb = b;
+
+	if ((uintptr_t)ma->from < (uintptr_t)mb->from) {
+		return -1;
+	}
+	if ((uintptr_t)ma->from > (uintptr_t)mb->from) {
+		return 1;
+	}
+	return 0;
+}
+
+Circle *
+circleClone(Circle *c)
+{
+	Circle *clone;
+	NodeMap *map = NULL;
+	uint64_t numNodes = 0;
+	uint64_t i;
 	Node *n;
 
-	n = calloc(1, sizeof(*n));
-	if (n == NULL) {
-		fprintf(stderr, "Can't alloc node: %s\n", strerror(errno));
+	clone = circleAlloc(c->hashFunc);
+	if (clone == NULL) {
 		return NULL;
 	}
-	n->name = name;
-	n->data = data;
-	n->weight = weight;
+	clone->totalWeight = c->totalWeight;
+	clone->totalLoad = c->totalLoad;
+	clone->loadFactor = c->loadFactor;
+
+	for (n = c->nodes; n; n = n->next) {
+		numNodes++;
+	}
+
+	map = malloc(numNodes * sizeof(*map));
+	clone->points = malloc(c->numPoints * sizeof(*clone->points));
+	if ((map == NULL && numNodes > 0) ||
+		(clone->points == NULL && c->numPoints > 0)) {
+		fprintf(stderr, "Can't alloc circle clone: %s\n", strerror(errno));
+		goto error;
+	}
 
 	/*
-	 * Add points to the circle for the new node based on it's weight.
+	 * Copy the nodes, keeping the list in the same order.
 	 */
-	uint64_t x;
-	for (x = 0; x < n->weight; x++) {
-		/*
-		 * Create a new point.
-		 */
-		char *pname = NULL;
-		asprintf(&pname, "%s-%" PRIu64, name, x);
-		uint64_t hash = c->hashFunc(pname, strlen(pname));
-		free(pname);
-
-		int exactMatch;
-		uint64_t i = indexOfClosestPoint(c, hash, &exactMatch);
-		if (exactMatch) {
+	Node *tail = NULL;
+	for (n = c->nodes, i = 0; n; n = n->next, i++) {
+		Node *copy = malloc(sizeof(*copy));
+		if (copy == NULL) {
+			fprintf(stderr, "Can't alloc node: %s\n", strerror(errno));
+			goto error;
+		}
+		*copy = *n;
+		copy->prev = tail;
+		copy->next = NULL;
+		if (tail) {
+			tail->next = copy;
+		} else {
+			clone->nodes = copy;
+		}
+		tail = copy;
+
+		map[i].from = n;
+		map[i].to = copy;
+	}
+	qsort(map, numNodes, sizeof(*map), nodeMapCompare);
+
+	/*
+	 * Copy the points and point them at the copied nodes.
+	 */
+	memcpy(clone->points, c->points, c->numPoints * sizeof(*c->points));
+	clone->numPoints = c->numPoints;
+	for (i = 0; i < clone->numPoints; i++) {
+		NodeMap key = { .from = clone->points[i].node };
+		NodeMap *m = bsearch(&key, map, numNodes, sizeof(*map), nodeMapCompare);
+		clone->points[i].node = m->to;
+	}
+
+	if (circleSetPrefixBits(clone, c->prefixBits) < 0 || indexPoints(clone) < 0 ||
+	    circleSetReplicaDepth(clone, c->replicaDepth) < 0) {
+		goto error;
+	}
+
+	free(map);
+
+	return clone;
+
+error:
+
+	free(map);
+	circleFree(&clone);
+	return NULL;
+}
+
+Node *
+circleFindNode(Circle *c, char *name)
+{
+	Node *n;
+
+	for (n = c->nodes; n; n = n->next) {
+		if (strcmp(n->name, name) == 0) {
+			return n;
+		}
+	}
+
+	return NULL;
+}
+
+static int
+pointCompare(const void *a, const void *b)
+{
+	const Point *pa = a;
+	const Point *pb = b;
+
+	if (pa->hash < pb->hash) {
+		return -1;
+	}
+	if (pa->hash > pb->hash) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Hash of point 'x' of a node whose name hashes to 'nameHash'.
+ *
+ * Points are spread by mixing the name hash with x instead of hashing a
+ * "name-x" string, so no memory is touched per point. The mix is a
+ * bijection and the odd multiplier keeps 'nameHash + x * K' distinct for
+ * every x, so the points of one node never collide with each other.
+ */
+static inline uint64_t
+pointHash(uint64_t nameHash, uint64_t x)
+{
+	return mixHash(nameHash + x * 0x9e3779b97f4a7c15ULL);
+}
+/*
+ * Merge the sorted array 'add' into the Circle's points using a single
+ * allocation and a single pass over both arrays.
+ *
+ * On success, 0 is returned and 'add' is left untouched.
+ * On error, -1 is returned and the Circle is unchanged.
+ */
+static int
+mergePoints(Circle *c, Point *add, uint64_t numAdd)
+{
+	Point *merged;
+
+	merged = malloc((c->numPoints + numAdd) * sizeof(*merged));
+	if (merged == NULL) {
+		fprintf(stderr, "Can't alloc points: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/*
+	 * Grow the index now so rebuilding it below can't fail.
+	 */
+	if (reserveIndex(c, c->numPoints + numAdd) < 0) {
+		free(merged);
+		return -1;
+	}
+
+	uint64_t i = 0, j = 0, k = 0;
+	while (i < c->numPoints && j < numAdd) {
+		if (c->points[i].hash < add[j].hash) {
+			merged[k++] = c->points[i++];
+		} else if (c->points[i].hash > add[j].hash) {
+			merged[k++] = add[j++];
+		} else {
 			fprintf(stderr, "Point already exists on the circle?!\n");
-			free(n);
-			return NULL;
+			free(merged);
+			return -1;
 		}
+	}
+	while (i < c->numPoints) {
+		merged[k++] = c->points[i++];
+	}
+	while (j < numAdd) {
+		merged[k++] = add[j++];
+	}
 
-		c->points = realloc(c->points, (c->numPoints + 1) * sizeof(*c->points));
+	free(c->points);
+	c->points = merged;
+	c->numPoints = k;
+
+	return indexPoints(c);
+}
 
-		if (i < c->numPoints) {
-			uint64_t bytesToMove = (c->numPoints - i) * sizeof(*c->points);
-			memmove(c->points + i + 1, c->points + i, bytesToMove);
+int
+circleInsertBatch(Circle *c, char **names, void **data, int *weights,
+                  uint64_t numNodes, Node **nodes)
+{
+	Node **new;
+	Point *add = NULL;
+	uint64_t numAdd = 0;
+	uint64_t i, x;
+
+	for (i = 0; i < numNodes; i++) {
+		if (weights[i] < 0) {
+			fprintf(stderr, "%s(%p, %s, %d): Invalid arguments?!\n", __func__, c, names[i], weights[i]);
+			return -1;
 		}
+	}
 
-		c->numPoints++;
-		c->points[i].hash = hash;
-		c->points[i].x = x;
-		c->points[i].node = n;
+	new = calloc(numNodes, sizeof(*new));
+	if (new == NULL) {
+		fprintf(stderr, "Can't alloc node list: %s\n", strerror(errno));
+		return -1;
 	}
 
 	/*
-	 * Add it to the nodes list.
+	 * Create all of the new nodes and count how many points they need.
 	 */
-	n->next = c->nodes;
-	if (c->nodes) {
-		c->nodes->prev = n;
+	for (i = 0; i < numNodes; i++) {
+		new[i] = calloc(1, sizeof(*new[i]));
+		if (new[i] == NULL) {
+			fprintf(stderr, "Can't alloc node: %s\n", strerror(errno));
+			goto error;
+		}
+		new[i]->name = names[i];
+		new[i]->data = data ? data[i] : NULL;
+		new[i]->weight = weights[i];
+
+		numAdd += new[i]->weight;
+	}
+
+	/*
+	 * Generate every point up front, then sort them once.
+	 */
+	add = malloc(numAdd * sizeof(*add));
+	if (add == NULL && numAdd > 0) {
+		fprintf(stderr, "Can't alloc points: %s\n", strerror(errno));
+		goto error;
+	}
+
+	Point *p = add;
+	for (i = 0; i < numNodes; i++) {
+		uint64_t nameHash = c->hashFunc(new[i]->name, strlen(new[i]->name));
+		for (x = 0; x < new[i]->weight; x++, p++) {
+			p->hash = pointHash(nameHash, x);
+			p->x = x;
+			p->node = new[i];
+		}
+	}
+
+	qsort(add, numAdd, sizeof(*add), pointCompare);
+
+	for (i = 1; i < numAdd; i++) {
+		if (add[i].hash == add[i-1].hash) {
+			fprintf(stderr, "Point already exists on the circle?!\n");
+			goto error;
+		}
+	}
+
+	if (mergePoints(c, add, numAdd) < 0) {
+		goto error;
+	}
+	free(add);
+
+	/*
+	 * Add them to the nodes list.
+	 */
+	for (i = 0; i < numNodes; i++) {
+		Node *n = new[i];
+
+		n->next = c->nodes;
+		if (c->nodes) {
+			c->nodes->prev = n;
+		}
+		c->nodes = n;
+		c->totalWeight += n->weight;
+
+		if (nodes) {
+			nodes[i] = n;
+		}
+	}
+	free(new);
+
+	return 0;
+
+error:
+
+	for (i = 0; i < numNodes; i++) {
+		free(new[i]);
+	}
+	free(new);
+	free(add);
+	return -1;
+}
+
+Circle *
+circleBuild(hashFunction hashFunc, char **names, void **data, int *weights,
+            uint64_t numNodes)
+{
+	Circle *c;
+
+	c = circleAlloc(hashFunc);
+	if (c == NULL) {
+		return NULL;
+	}
+
+	if (circleInsertBatch(c, names, data, weights, numNodes, NULL) < 0) {
+		circleFree(&c);
+		return NULL;
+	}
+
+	return c;
+}
+
+Node *
+circleInsert(Circle *c, char *name, void *data, int weight)
+{
+	Node *n;
+
+	if (circleInsertBatch(c, &name, &data, &weight, 1, &n) < 0) {
+		return NULL;
 	}
-	c->nodes = n;
 
 	return n;
 }
 
+/*
+ * Drop every point owned by 'n' whose x is 'minX' or greater, in a single
+ * compaction pass over the points array.
+ */
+static void
+compactPoints(Circle *c, Node *n, uint64_t minX)
+{
+	uint64_t i, k;
+
+	for (i = 0, k = 0; i < c->numPoints; i++) {
+		if (c->points[i].node == n && c->points[i].x >= minX) {
+			continue;
+		}
+		c->points[k++] = c->points[i];
+	}
+	c->numPoints = k;
+
+	if (k == 0) {
+		free(c->points);
+		c->points = NULL;
+	} else {
+		Point *shrunk = realloc(c->points, k * sizeof(*c->points));
+		if (shrunk) {
+			c->points = shrunk;
+		}
+	}
+
+	/*
+	 * Shrinking can't fail, so neither can this.
+	 */
+	indexPoints(c);
+}
+
+int
+circleRemove(Circle *c, Node *n)
+{
+	if (c == NULL || n == NULL) {
+		fprintf(stderr, "%s(%p, %p): Invalid arguments?!\n", __func__, c, n);
+		return -1;
+	}
+
+	compactPoints(c, n, 0);
+
+	/*
+	 * Unlink it from the nodes list.
+	 */
+	if (n->prev) {
+		n->prev->next = n->next;
+	} else {
+		c->nodes = n->next;
+	}
+	if (n->next) {
+		n->next->prev = n->prev;
+	}
+
+	c->totalWeight -= n->weight;
+	c->totalLoad -= n->load;
+	free(n);
+
+	return 0;
+}
+
+int
+circleReweight(Circle *c, Node *n, int weight)
+{
+	if (c == NULL || n == NULL || weight < 0) {
+		fprintf(stderr, "%s(%p, %p, %d): Invalid arguments?!\n", __func__, c, n, weight);
+		return -1;
+	}
+
+	if (weight < n->weight) {
+		compactPoints(c, n, weight);
+		c->totalWeight -= n->weight - weight;
+		n->weight = weight;
+		return 0;
+	}
+
+	/*
+	 * Only generate the points this node is missing: x in [weight, newWeight).
+	 */
+	uint64_t numAdd = weight - n->weight;
+	if (numAdd == 0) {
+		return 0;
+	}
+
+	Point *add = malloc(numAdd * sizeof(*add));
+	if (add == NULL) {
+		fprintf(stderr, "Can't alloc points: %s\n", strerror(errno));
+		return -1;
+	}
+
+	uint64_t nameHash = c->hashFunc(n->name, strlen(n->name));
+	uint64_t i;
+	for (i = 0; i < numAdd; i++) {
+		add[i].x = n->weight + i;
+		add[i].hash = pointHash(nameHash, add[i].x);
+		add[i].node = n;
+	}
+	qsort(add, numAdd, sizeof(*add), pointCompare);
+
+	for (i = 1; i < numAdd; i++) {
+		if (add[i].hash == add[i-1].hash) {
+			fprintf(stderr, "Point already exists on the circle?!\n");
+			free(add);
+			return -1;
+		}
+	}
+
+	if (mergePoints(c, add, numAdd) < 0) {
+		free(add);
+		return -1;
+	}
+	free(add);
+
+	c->totalWeight += weight - n->weight;
+	n->weight = weight;
+
+	return 0;
+}
+
 Point *
 circleClosestPoint(Circle *c, char *name)
 {
 	uint64_t hash = c->hashFunc(name, strlen(name));
-	uint64_t i = indexOfClosestPoint(c, hash, NULL);
+	uint64_t i = indexOfClosestPoint(c, hash);
 	if (i == c->numPoints) {
 		i = 0;
 	}
 	return c->points + i;
 }
 
+/*
+ * Number of lookups interleaved by searchBatch().
+ */
+#define BATCH_WIDTH 32
+
+/*
+ * Find the closest point index for each of the 'width' (at most
+ * BATCH_WIDTH) hashes at once, so their memory latency overlaps. The
+ * Circle must not be empty.
+ */
+static void
+searchBatch(Circle *c, const uint64_t *hash, size_t width, uint64_t *index)
+{
+	size_t i;
+
+	if (c->prefix) {
+		/*
+		 * Each key only searches its own bucket, so prefetch every key's
+		 * bucket bounds, then every key's first hash, then do the short
+		 * searches.
+		 */
+		int shift = 64 - c->prefixBits;
+
+		for (i = 0; i < width; i++) {
+			__builtin_prefetch(c->prefix + (hash[i] >> shift));
+		}
+		for (i = 0; i < width; i++) {
+			index[i] = c->prefix[hash[i] >> shift];
+			__builtin_prefetch(c->hashes + index[i]);
+		}
+		for (i = 0; i < width; i++) {
+			uint64_t lo = index[i];
+			uint64_t hi = c->prefix[(hash[i] >> shift) + 1];
+			index[i] = lo + circleSearch(c->hashes + lo, hi - lo, hash[i]);
+			if (index[i] == c->numPoints) {
+				index[i] = 0;
+			}
+		}
+		return;
+	}
+
+	/*
+	 * Every search over the same array takes the same sequence of steps,
+	 * so run them in lockstep. The loads of one step are independent of
+	 * each other, and the next probe of each search is prefetched before
+	 * moving on to the next search.
+	 */
+	const uint64_t *base[BATCH_WIDTH];
+	for (i = 0; i < width; i++) {
+		base[i] = c->hashes;
+	}
+
+	uint64_t len = c->numPoints;
+	while (len > 1) {
+		uint64_t half = len / 2;
+		uint64_t next = (len - half) / 2;
+
+		for (i = 0; i < width; i++) {
+			base[i] += half & -(uint64_t)(base[i][half - 1] < hash[i]);
+			__builtin_prefetch(base[i] + next);
+		}
+		len -= half;
+	}
+
+	for (i = 0; i < width; i++) {
+		index[i] = (base[i] - c->hashes) + (*base[i] < hash[i]);
+		if (index[i] == c->numPoints) {
+			index[i] = 0;
+		}
+	}
+}
+
+void
+circleClosestPointBatch(Circle *c, char **keys, size_t n, Point **out)
+{
+	uint64_t hash[BATCH_WIDTH];
+	uint64_t index[BATCH_WIDTH];
+	size_t done, i;
+
+	for (done = 0; done < n; done += BATCH_WIDTH) {
+		size_t width = n - done < BATCH_WIDTH ? n - done : BATCH_WIDTH;
+
+		if (c->numPoints == 0) {
+			for (i = 0; i < width; i++) {
+				out[done + i] = c->points;
+			}
+			continue;
+		}
+
+		/*
+		 * Hash all of the keys first.
+		 */
+		for (i = 0; i < width; i++) {
+			char *key = keys[done + i];
+			hash[i] = c->hashFunc(key, strlen(key));
+		}
+
+		searchBatch(c, hash, width, index);
+
+		for (i = 0; i < width; i++) {
+			out[done + i] = c->points + index[i];
+		}
+	}
+}
+
+Point *
+circleMultiProbePoint(Circle *c, char *key, int k)
+{
+	uint64_t probe[BATCH_WIDTH];
+	uint64_t index[BATCH_WIDTH];
+	int done, j;
+
+	if (c->numPoints == 0 || k <= 0) {
+		return NULL;
+	}
+	if (k == 1) {
+		return circleClosestPoint(c, key);
+	}
+
+	uint64_t hash = c->hashFunc(key, strlen(key));
+	uint64_t best = 0;
+	uint64_t bestDistance = UINT64_MAX;
+
+	for (done = 0; done < k; done += BATCH_WIDTH) {
+		int width = k - done < BATCH_WIDTH ? k - done : BATCH_WIDTH;
+
+		/*
+		 * The first probe is the key's own hash, so one probe is the same
+		 * as circleClosestPoint(). The rest are spread with the same mix
+		 * used for virtual points. The probes are searched as a batch.
+		 */
+		for (j = 0; j < width; j++) {
+			probe[j] = done + j ? pointHash(hash, done + j) : hash;
+		}
+
+		searchBatch(c, probe, width, index);
+
+		/*
+		 * Clockwise distance, which wraps around correctly in unsigned
+		 * arithmetic.
+		 */
+		for (j = 0; j < width; j++) {
+			uint64_t distance = c->hashes[index[j]] - probe[j];
+			if (distance < bestDistance) {
+				bestDistance = distance;
+				best = index[j];
+			}
+		}
+	}
+
+	return c->points + best;
+}
+
+int
+circleReplicas(Circle *c, char *key, int n, Node **out)
+{
+	int count = 0;
+
+	if (c->numPoints == 0 || n <= 0) {
+		return 0;
+	}
+
+	uint64_t start = indexOfClosestPoint(c, c->hashFunc(key, strlen(key)));
+	if (start == c->numPoints) {
+		start = 0;
+	}
+
+	if (n <= c->replicaDepth) {
+		Node **list = c->replicas + start * c->replicaDepth;
+		for (; count < n && list[count]; count++) {
+			out[count] = list[count];
+		}
+		return count;
+	}
+
+	out[count++] = c->points[start].node;
+
+	/*
+	 * Jump from run to run of same-node points. Stop once the next jump
+	 * would go past where we started.
+	 */
+	uint64_t i = start;
+	uint64_t offset = 0;
+	while (count < n) {
+		uint64_t next = c->nextDistinct[i];
+		uint64_t nextOffset = (next + c->numPoints - start) % c->numPoints;
+		if (nextOffset <= offset) {
+			break;
+		}
+		i = next;
+		offset = nextOffset;
+
+		Node *node = c->points[i].node;
+		int j;
+		for (j = 0; j < count && out[j] != node; j++);
+		if (j == count) {
+			out[count++] = node;
+		}
+	}
+
+	return count;
+}
+
+int
+circleSetLoadBound(Circle *c, double factor)
+{
+	if (factor != 0 && factor < 1) {
+		fprintf(stderr, "%s(%p, %f): Invalid arguments?!\n", __func__, c, factor);
+		return -1;
+	}
+	c->loadFactor = factor;
+	return 0;
+}
+
+/*
+ * Can node 'n' take one more key without going over its bound?
+ */
+static int
+hasCapacity(Circle *c, Node *n)
+{
+	double capacity = ceil(c->loadFactor * (c->totalLoad + 1) * n->weight / c->totalWeight);
+	return n->load < capacity;
+}
+
+Point *
+circleAssign(Circle *c, char *key)
+{
+	if (c->numPoints == 0) {
+		return NULL;
+	}
+
+	uint64_t start = indexOfClosestPoint(c, c->hashFunc(key, strlen(key)));
+	if (start == c->numPoints) {
+		start = 0;
+	}
+
+	/*
+	 * Walk forward past full nodes, skipping the rest of a full node's
+	 * run of points at once. There is always room somewhere since the
+	 * bounds add up to at least one more than the current load.
+	 */
+	uint64_t i = start;
+	if (c->loadFactor != 0) {
+		uint64_t offset = 0;
+		while (!hasCapacity(c, c->points[i].node)) {
+			uint64_t next = c->nextDistinct[i];
+			uint64_t nextOffset = (next + c->numPoints - start) % c->numPoints;
+			if (nextOffset <= offset) {
+				i = start;
+				break;
+			}
+			i = next;
+			offset = nextOffset;
+		}
+	}
+
+	c->points[i].node->load++;
+	c->totalLoad++;
+
+	return c->points + i;
+}
+
+void
+circleRelease(Circle *c, Node *n)
+{
+	if (n->load == 0) {
+		return;
+	}
+	n->load--;
+	c->totalLoad--;
+}
+
+static int
+sameNode(Node *a, Node *b)
+{
+	if (a == b) {
+		return 1;
+	}
+	if (a == NULL || b == NULL) {
+		return 0;
+	}
+	return strcmp(a->name, b->name) == 0;
+}
+
+typedef struct RangeList {
+	CircleRange *ranges;
+	int64_t num;
+	int64_t max;
+} RangeList;
+
+/*
+ * Record that hashes in [first, last] move from 'from' to 'to', extending
+ * the previous range if it is adjacent and between the same nodes.
+ */
+static int
+addRange(RangeList *l, uint64_t first, uint64_t last, Node *from, Node *to)
+{
+	if (l->num > 0) {
+		CircleRange *prev = l->ranges + l->num - 1;
+		if (prev->last + 1 == first && prev->from == from && prev->to == to) {
+			prev->last = last;
+			return 0;
+		}
+	}
+
+	if (l->num == l->max) {
+		int64_t max = l->max ? l->max * 2 : 16;
+		CircleRange *ranges = realloc(l->ranges, max * sizeof(*ranges));
+		if (ranges == NULL) {
+			fprintf(stderr, "Can't alloc ranges: %s\n", strerror(errno));
+			return -1;
+		}
+		l->ranges = ranges;
+		l->max = max;
+	}
+
+	CircleRange *r = l->ranges + l->num++;
+	r->first = first;
+	r->last = last;
+	r->from = from;
+	r->to = to;
+
+	return 0;
+}
+
+/*
+ * Compare the owners of every hash in one merge pass over both sorted
+ * point arrays. Between two consecutive point hashes (from either array)
+ * the owner on each side can't change, so each such segment is compared
+ * once.
+ */
+static int64_t
+diffPoints(Point *a, uint64_t na, Point *b, uint64_t nb, CircleRange **ranges)
+{
+	RangeList l = {0};
+	uint64_t ia = 0, ib = 0;
+	uint64_t first = 0;
+
+	while (ia < na || ib < nb) {
+		uint64_t v;
+		if (ib == nb || (ia < na && a[ia].hash <= b[ib].hash)) {
+			v = a[ia].hash;
+		} else {
+			v = b[ib].hash;
+		}
+
+		/*
+		 * [first, v] is owned by the next point on each side, wrapping
+		 * around to the first point past the end.
+		 */
+		Node *from = na ? a[ia < na ? ia : 0].node : NULL;
+		Node *to = nb ? b[ib < nb ? ib : 0].node : NULL;
+		if (!sameNode(from, to) && addRange(&l, first, v, from, to) < 0) {
+			goto error;
+		}
+
+		while (ia < na && a[ia].hash == v) {
+			ia++;
+		}
+		while (ib < nb && b[ib].hash == v) {
+			ib++;
+		}
+
+		if (v == UINT64_MAX) {
+			*ranges = l.ranges;
+			return l.num;
+		}
+		first = v + 1;
+	}
+
+	/*
+	 * Past the last point, both sides wrap around to their first point.
+	 */
+	Node *from = na ? a[0].node : NULL;
+	Node *to = nb ? b[0].node : NULL;
+	if (!sameNode(from, to) && addRange(&l, first, UINT64_MAX, from, to) < 0) {
+		goto error;
+	}
+
+	*ranges = l.ranges;
+	return l.num;
+
+error:
+
+	free(l.ranges);
+	return -1;
+}
+
+int64_t
+circleDiff(Circle *a, Circle *b, CircleRange **ranges)
+{
+	return diffPoints(a->points, a->numPoints, b->points, b->numPoints, ranges);
+}
+
+int64_t
+circleDiffInsert(Circle *c, Node *pending, CircleRange **ranges)
+{
+	uint64_t numAdd = pending->weight;
+	Point *add = malloc(numAdd * sizeof(*add));
+	Point *after = malloc((c->numPoints + numAdd) * sizeof(*after));
+	if ((add == NULL && numAdd > 0) || (after == NULL && c->numPoints + numAdd > 0)) {
+		fprintf(stderr, "Can't alloc points: %s\n", strerror(errno));
+		free(add);
+		free(after);
+		return -1;
+	}
+
+	uint64_t nameHash = c->hashFunc(pending->name, strlen(pending->name));
+	uint64_t x;
+	for (x = 0; x < numAdd; x++) {
+		add[x].hash = pointHash(nameHash, x);
+		add[x].x = x;
+		add[x].node = pending;
+	}
+	qsort(add, numAdd, sizeof(*add), pointCompare);
+
+	/*
+	 * On a hash collision the existing point keeps the slot, which is
+	 * what circleInsert() would refuse anyway.
+	 */
+	uint64_t i = 0, j = 0, k = 0;
+	while (i < c->numPoints || j < numAdd) {
+		if (j == numAdd || (i < c->numPoints && c->points[i].hash <= add[j].hash)) {
+			if (j < numAdd && c->points[i].hash == add[j].hash) {
+				j++;
+			}
+			after[k++] = c->points[i++];
+		} else {
+			after[k++] = add[j++];
+		}
+	}
+
+	int64_t num = diffPoints(c->points, c->numPoints, after, k, ranges);
+
+	free(add);
+	free(after);
+
+	return num;
+}
+
+int64_t
+circleDiffRemove(Circle *c, Node *n, CircleRange **ranges)
+{
+	Point *after = malloc(c->numPoints * sizeof(*after));
+	if (after == NULL && c->numPoints > 0) {
+		fprintf(stderr, "Can't alloc points: %s\n", strerror(errno));
+		return -1;
+	}
+
+	uint64_t i, k;
+	for (i = 0, k = 0; i < c->numPoints; i++) {
+		if (c->points[i].node != n) {
+			after[k++] = c->points[i];
+		}
+	}
+
+	int64_t num = diffPoints(c->points, c->numPoints, after, k, ranges);
+
+	free(after);
+
+	return num;
+}
+
 static uint64_t
 getPointIndex(Circle *c, Point *p)
 {
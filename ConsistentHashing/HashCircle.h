@@ -2,6 +2,7 @@
 #define __HASH_CIRCLE_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 typedef struct Node {
 	char *name;
@@ -9,6 +10,11 @@ typedef struct Node {
 
 	uint64_t weight;
 
+	/*
+	 * Number of keys currently assigned with circleAssign().
+	 */
+	uint64_t load;
+
 	struct Node *prev;
 	struct Node *next;
 } Node;
@@ -19,6 +25,17 @@ typedef struct Point {
 	Node *node;
 } Point;
 
+/*
+ * Keys whose hash is in [first, last] (inclusive) move from node 'from'
+ * to node 'to'. Either node is NULL if that Circle is empty.
+ */
+typedef struct CircleRange {
+	uint64_t first;
+	uint64_t last;
+	Node *from;
+	Node *to;
+} CircleRange;
+
 typedef uint64_t (*hashFunction)(void *key, uint64_t len);
 
 typedef struct Circle {
@@ -33,22 +50,242 @@ typedef struct Circle {
 	Point *points;
 	uint64_t numPoints;
 
+	/*
+	 * Copy of the point hashes in the same order. Lookups search this
+	 * dense array and only read 'points' for the final hit.
+	 */
+	uint64_t *hashes;
+
+	/*
+	 * For each point, the index of the next point clockwise that belongs
+	 * to a different node.
+	 */
+	uint64_t *nextDistinct;
+
+	/*
+	 * Optional replica index: for each point, the first 'replicaDepth'
+	 * distinct nodes clockwise from it, starting with its own, in
+	 * replicas[i * replicaDepth ...]. Lists are NULL padded when the
+	 * Circle has fewer nodes.
+	 */
+	Node **replicas;
+	int replicaDepth;
+
+	/*
+	 * Optional radix table over the top 'prefixBits' bits of the hash.
+	 * prefix[b] is the index of the first point in bucket 'b', so a
+	 * lookup only searches [prefix[b], prefix[b + 1]).
+	 */
+	uint64_t *prefix;
+	int prefixBits;
+
 	hashFunction hashFunc;
+
+	/*
+	 * Bounded-load mode. When 'loadFactor' is not 0, circleAssign() won't
+	 * give a node more than 'loadFactor' times its weighted share of the
+	 * assigned keys.
+	 */
+	double loadFactor;
+	uint64_t totalLoad;
+	uint64_t totalWeight;
 } Circle;
 
 /*
  * Allocate a new Circle handle.
  *
  * The 'hashFunc' is the hashing function the Circle will use when
- * hashing points onto the circle.
+ * hashing node names and keys onto the circle. If it is NULL, the
+ * built-in wyHash() is used.
  *
  * On success, a pointer to the opened Circle is returned.
  * On error, NULL is returned.
  */
 Circle *circleAlloc(hashFunction hashFunc);
 
+/*
+ * Free the Circle, its points and its nodes. The node names and data are
+ * owned by the caller and are not freed.
+ */
+void circleFree(Circle **c);
+
+/*
+ * Make a deep copy of the Circle. The copy has its own Node structs (with
+ * the same names, data and weights) and its own points, so it can be
+ * changed without affecting the original.
+ *
+ * On success, a pointer to the copy is returned.
+ * On error, NULL is returned.
+ */
+Circle *circleClone(Circle *c);
+
+/*
+ * Find the node called 'name'.
+ *
+ * Returns NULL if there is no such node.
+ */
+Node *circleFindNode(Circle *c, char *name);
+
+/*
+ * Insert 'numNodes' nodes at once. Node 'i' is named 'names[i]', carries
+ * 'data[i]' (or NULL if 'data' is NULL) and gets 'weights[i]' points.
+ *
+ * All points are generated and sorted once, then merged into the Circle
+ * with a single allocation, so building a ring of P points is O(P log P).
+ * If 'nodes' is not NULL, the new Node pointers are stored in it.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and the Circle is left unchanged.
+ */
+int circleInsertBatch(Circle *c, char **names, void **data, int *weights,
+                      uint64_t numNodes, Node **nodes);
+
+/*
+ * Allocate a new Circle and insert all of the given nodes with
+ * circleInsertBatch().
+ *
+ * On success, a pointer to the new Circle is returned.
+ * On error, NULL is returned.
+ */
+Circle *circleBuild(hashFunction hashFunc, char **names, void **data, int *weights,
+                    uint64_t numNodes);
+
 Node *circleInsert(Circle *c, char *name, void *data, int weight);
+/*
+ * Remove the node 'n' and all of its points from the Circle in a single
+ * compaction pass over the points array. The node is freed.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned.
+ */
+int circleRemove(Circle *c, Node *n);
+
+/*
+ * Change the weight of node 'n'. Lowering the weight drops the node's
+ * highest points in one compaction pass. Raising it generates only the
+ * missing points and merges them in one pass. Other nodes are untouched.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and the Circle is left unchanged.
+ */
+int circleReweight(Circle *c, Node *n, int weight);
+
+/*
+ * The most prefix bits: a 128 MB table, far past the point where it stops
+ * fitting in cache and makes lookups slower.
+ */
+#define CIRCLE_MAX_PREFIX_BITS 24
+
+/*
+ * Turn on the prefix table with 2^bits buckets, or turn it off with a
+ * 'bits' of 0. 'bits' may be at most CIRCLE_MAX_PREFIX_BITS. It is kept up
+ * to date as points change. With about one point per bucket (bits close
+ * to log2(numPoints), e.g. 12-20) a lookup probes only a couple of hashes.
+ * The table costs 8 * 2^bits bytes.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and the table is left unchanged.
+ */
+int circleSetPrefixBits(Circle *c, int bits);
+
+/*
+ * Turn on the replica index for preference lists of up to 'depth' nodes,
+ * or turn it off with a 'depth' of 0. It is kept up to date as points
+ * change. The index costs 8 * depth bytes per point.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and the index is left unchanged.
+ */
+int circleSetReplicaDepth(Circle *c, int depth);
+
+/*
+ * Find the index of the first of the 'numHashes' sorted 'hashes' that is
+ * >= 'hash', or 'numHashes' if there is none, with a branchless binary
+ * search.
+ */
+uint64_t circleSearch(const uint64_t *hashes, uint64_t numHashes, uint64_t hash);
+
 Point *circleClosestPoint(Circle *c, char *name);
+
+/*
+ * Multi-probe lookup: hash 'key' to 'k' probe positions and return the
+ * point closest (clockwise) to any of them. With one point per node
+ * (weight 1) and k = 21, the load is about as even as with hundreds of
+ * virtual points per node, at a fraction of the memory. k = 1 is the same
+ * as circleClosestPoint().
+ *
+ * Returns NULL if the Circle is empty or 'k' is not positive.
+ */
+Point *circleMultiProbePoint(Circle *c, char *key, int k);
+
+/*
+ * Find the closest point for each of the 'n' 'keys' and store it in 'out'.
+ * The same as calling circleClosestPoint() on every key, but all keys of a
+ * batch are hashed first and their searches are interleaved with software
+ * prefetch so the memory latency of many lookups overlaps.
+ */
+void circleClosestPointBatch(Circle *c, char **keys, size_t n, Point **out);
+
+/*
+ * Find the first 'n' distinct nodes clockwise from 'key', starting with
+ * the node circleClosestPoint() returns, and store them in 'out'. This is
+ * the preference list for replicating 'key' to 'n' nodes.
+ *
+ * With a replica index at least 'n' deep, the list is copied out after the
+ * first search. Otherwise the points are walked, jumping over each whole
+ * run of points that belong to the same node, but still visiting runs of
+ * nodes that are already in the list.
+ *
+ * Returns the number of nodes stored, which is less than 'n' if the
+ * Circle has fewer nodes.
+ */
+int circleReplicas(Circle *c, char *key, int n, Node **out);
+
+/*
+ * Turn on bounded-load mode. A node may be assigned at most
+ * ceil(factor * (totalLoad + 1) * weight / totalWeight) keys, e.g. a
+ * 'factor' of 1.25 keeps every node within 25% of its fair share. A
+ * 'factor' of 0 turns the bound off.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned.
+ */
+int circleSetLoadBound(Circle *c, double factor);
+
+/*
+ * Assign 'key' to a node and count it against that node's load. This is
+ * circleClosestPoint(), except that in bounded-load mode it walks forward
+ * (like circleNextPoint()) past nodes that are full.
+ *
+ * Returns NULL if the Circle is empty.
+ */
+Point *circleAssign(Circle *c, char *key);
+
+/*
+ * Give back one key assigned to node 'n' with circleAssign().
+ */
+void circleRelease(Circle *c, Node *n);
+
+/*
+ * Work out which hash ranges change owner going from Circle 'a' to Circle
+ * 'b', in one merge pass over both points arrays. Nodes are matched by
+ * name, so 'b' may be a circleClone() of 'a' that has since changed. Both
+ * Circles must use the same hash function.
+ *
+ * On success, the number of ranges is returned and '*ranges' points to a
+ * sorted array of them that the caller must free().
+ * On error, -1 is returned.
+ */
+int64_t circleDiff(Circle *a, Circle *b, CircleRange **ranges);
+
+/*
+ * Like circleDiff(), but against the Circle 'c' would become if the
+ * caller-built node 'pending' (name and weight) were inserted, or if node
+ * 'n' were removed. 'c' is not changed.
+ */
+int64_t circleDiffInsert(Circle *c, Node *pending, CircleRange **ranges);
+int64_t circleDiffRemove(Circle *c, Node *n, CircleRange **ranges);
+
 Point *circleNextPoint(Circle *c, Point *p);
 
 #endif /* __HASH_CIRCLE_H */
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "Maglev.h"
+#include "FastHash.h"
+
+static int
+isPrime(uint64_t n)
+{
+	uint64_t d;
+
+	if (n < 2) {
+		return 0;
+	}
+	for (d = 2; d * d <= n; d++) {
+		if (n % d == 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+Maglev *
+maglevAlloc(hashFunction hashFunc, uint64_t size)
+{
+	Maglev *m;
+
+	if (size < 3) {
+		size = 3;
+	}
+	while (!isPrime(size)) {
+		size++;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL) {
+		fprintf(stderr, "Can't alloc maglev: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	m->size = size;
+	m->hashFunc = hashFunc ? hashFunc : wyHash;
+
+	return m;
+}
+
+int64_t
+maglevBuild(Maglev *m, Node *nodes)
+{
+	uint64_t numNodes = 0;
+	uint64_t totalWeight = 0;
+	Node *n;
+
+	for (n = nodes; n; n = n->next) {
+		numNodes++;
+		totalWeight += n->weight;
+	}
+	if (totalWeight == 0) {
+		fprintf(stderr, "Can't build maglev table without weighted nodes\n");
+		return -1;
+	}
+
+	Node **table = calloc(m->size, sizeof(*table));
+	uint64_t *owners = malloc(m->size * sizeof(*owners));
+	uint64_t *hash = malloc(numNodes * sizeof(*hash));
+	uint64_t *pos = malloc(numNodes * sizeof(*pos));
+	uint64_t *skip = malloc(numNodes * sizeof(*skip));
+	Node **list = malloc(numNodes * sizeof(*list));
+	if (table == NULL || owners == NULL || hash == NULL || pos == NULL ||
+	    skip == NULL || list == NULL) {
+		fprintf(stderr, "Can't alloc maglev table: %s\n", strerror(errno));
+		free(table);
+		free(owners);
+		free(hash);
+		free(pos);
+		free(skip);
+		free(list);
+		return -1;
+	}
+
+	/*
+	 * Each node's permutation is offset, offset + skip, offset + 2*skip, ...
+	 * modulo the table size. Since the size is prime, every skip in
+	 * [1, size-1] visits every slot exactly once.
+	 */
+	uint64_t i = 0;
+	for (n = nodes; n; n = n->next, i++) {
+		uint64_t h = m->hashFunc(n->name, strlen(n->name));
+		list[i] = n;
+		hash[i] = h;
+		pos[i] = h % m->size;
+		skip[i] = mixHash(h) % (m->size - 1) + 1;
+	}
+
+	/*
+	 * Take turns claiming the next free slot in each node's permutation.
+	 * A node gets 'weight' turns per round.
+	 */
+	uint64_t filled = 0;
+	while (filled < m->size) {
+		for (i = 0; i < numNodes && filled < m->size; i++) {
+			uint64_t t;
+			for (t = 0; t < list[i]->weight && filled < m->size; t++) {
+				while (table[pos[i]] != NULL) {
+					pos[i] += skip[i];
+					if (pos[i] >= m->size) {
+						pos[i] -= m->size;
+					}
+				}
+				table[pos[i]] = list[i];
+				owners[pos[i]] = hash[i];
+				filled++;
+			}
+		}
+	}
+
+	int64_t moved = 0;
+	for (i = 0; i < m->size; i++) {
+		if (m->owners == NULL || m->owners[i] != owners[i]) {
+			moved++;
+		}
+	}
+
+	free(m->table);
+	free(m->owners);
+	m->table = table;
+	m->owners = owners;
+
+	free(hash);
+	free(pos);
+	free(skip);
+	free(list);
+
+	return moved;
+}
+
+Node *
+maglevLookup(Maglev *m, char *name)
+{
+	if (m->table == NULL) {
+		return NULL;
+	}
+	return m->table[m->hashFunc(name, strlen(name)) % m->size];
+}
+
+void
+maglevFree(Maglev **m)
+{
+	if (m == NULL || *m == NULL) {
+		return;
+	}
+
+	free((*m)->table);
+	free((*m)->owners);
+	free(*m);
+	*m = NULL;
+}
@@ -0,0 +1,61 @@
+#ifndef __MAGLEV_H
+#define __MAGLEV_H
+
+#include <inttypes.h>
+
+#include "HashCircle.h"
+
+/*
+ * Maglev lookup table.
+ *
+ * Every node fills a fixed-size, prime-length table by walking its own
+ * permutation of the slots. Nodes take turns in proportion to their
+ * weight, so each one ends up owning a share of the slots close to its
+ * share of the total weight. A lookup is one hash plus one array index.
+ */
+typedef struct Maglev {
+	Node **table;
+	uint64_t size;
+
+	/*
+	 * The name hash of each slot's node. A rebuild counts the slots that
+	 * changed node with these, so it never looks at the old nodes, which
+	 * may have been freed since.
+	 */
+	uint64_t *owners;
+
+	hashFunction hashFunc;
+} Maglev;
+
+/*
+ * Allocate a new Maglev handle. If 'hashFunc' is NULL, wyHash is used.
+ *
+ * The 'size' is rounded up to the next prime and should be much larger
+ * than the number of nodes (100x is a good start) to keep the load even.
+ *
+ * On success, a pointer to the new Maglev is returned.
+ * On error, NULL is returned.
+ */
+Maglev *maglevAlloc(hashFunction hashFunc, uint64_t size);
+
+/*
+ * (Re)build the table from the linked list of 'nodes', usually the
+ * 'nodes' list of a Circle, using each node's name and weight. Nodes
+ * removed since the last build may already have been freed.
+ *
+ * On success, the number of slots that changed node is returned. The
+ * fraction of keys moved by the rebuild is this divided by 'size'.
+ * On error, -1 is returned and the table is left unchanged.
+ */
+int64_t maglevBuild(Maglev *m, Node *nodes);
+
+/*
+ * Find the node that 'name' maps to.
+ *
+ * Returns NULL if the table has not been built.
+ */
+Node *maglevLookup(Maglev *m, char *name);
+
+void maglevFree(Maglev **m);
+
+#endif /* __MAGLEV_H */
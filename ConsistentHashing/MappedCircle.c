@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "MappedCircle.h"
+#include "FastHash.h"
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+/*
+ * Checksum a buffer 8 bytes at a time.
+ */
+static uint64_t
+checksum(const void *buf, uint64_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t sum = len;
+	uint64_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t word;
+		memcpy(&word, p + i, sizeof(word));
+		sum = mixHash(sum ^ word);
+	}
+	for (; i < len; i++) {
+		sum = mixHash(sum ^ p[i]);
+	}
+
+	return sum;
+}
+
+typedef struct NodeIndex {
+	Node *node;
+	uint32_t index;
+} NodeIndex;
+
+static int
+nodeIndexCompare(const void *a, const void *b)
+{
+	const NodeIndex *ia = a;
+	const NodeIndex *ib = b;
+
+	if ((uintptr_t)ia->node < (uintptr_t)ib->node) {
+		return -1;
+	}
+	if ((uintptr_t)ia->node > (uintptr_t)ib->node) {
+		return 1;
+	}
+	return 0;
+}
+
+int
+circleSave(Circle *c, const char *path)
+{
+	MappedHeader h = {0};
+	NodeIndex *index = NULL;
+	uint8_t *buf = NULL;
+	char *tmp = NULL;
+	FILE *f = NULL;
+	uint64_t i, namesSize = 0;
+	Node *n;
+
+	for (n = c->nodes; n; n = n->next) {
+		h.numNodes++;
+		namesSize += strlen(n->name) + 1;
+	}
+	if (h.numNodes > UINT32_MAX) {
+		fprintf(stderr, "Too many nodes to save: %" PRIu64 "\n", h.numNodes);
+		return -1;
+	}
+	h.numPoints = c->numPoints;
+
+	memcpy(h.magic, MAPPED_CIRCLE_MAGIC, sizeof(h.magic));
+	h.version = MAPPED_CIRCLE_VERSION;
+	h.headerSize = sizeof(h);
+	h.hashesOffset = ALIGN8(sizeof(h));
+	h.nodeIndexOffset = h.hashesOffset + h.numPoints * sizeof(uint64_t);
+	h.nodesOffset = ALIGN8(h.nodeIndexOffset + h.numPoints * sizeof(uint32_t));
+	h.namesOffset = h.nodesOffset + h.numNodes * sizeof(MappedNode);
+	h.fileSize = ALIGN8(h.namesOffset + namesSize);
+
+	/*
+	 * Lay the whole file out in memory.
+	 */
+	buf = calloc(1, h.fileSize);
+	index = malloc(h.numNodes * sizeof(*index));
+	if (buf == NULL || (index == NULL && h.numNodes > 0)) {
+		fprintf(stderr, "Can't alloc snapshot: %s\n", strerror(errno));
+		goto error;
+	}
+
+	MappedNode *nodes = (MappedNode *)(buf + h.nodesOffset);
+	char *names = (char *)(buf + h.namesOffset);
+	uint64_t nameOffset = 0;
+	for (n = c->nodes, i = 0; n; n = n->next, i++) {
+		nodes[i].nameOffset = nameOffset;
+		nodes[i].weight = n->weight;
+		strcpy(names + nameOffset, n->name);
+		nameOffset += strlen(n->name) + 1;
+
+		index[i].node = n;
+		index[i].index = i;
+	}
+	qsort(index, h.numNodes, sizeof(*index), nodeIndexCompare);
+
+	uint64_t *hashes = (uint64_t *)(buf + h.hashesOffset);
+	uint32_t *nodeIndex = (uint32_t *)(buf + h.nodeIndexOffset);
+	for (i = 0; i < h.numPoints; i++) {
+		NodeIndex key = { .node = c->points[i].node };
+		NodeIndex *found = bsearch(&key, index, h.numNodes, sizeof(*index), nodeIndexCompare);
+		hashes[i] = c->points[i].hash;
+		nodeIndex[i] = found->index;
+	}
+
+	h.checksum = checksum(buf + sizeof(h), h.fileSize - sizeof(h));
+	memcpy(buf, &h, sizeof(h));
+
+	if (asprintf(&tmp, "%s.tmp", path) < 0) {
+		tmp = NULL;
+		fprintf(stderr, "Can't alloc path: %s\n", strerror(errno));
+		goto error;
+	}
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Can't open %s: %s\n", tmp, strerror(errno));
+		goto error;
+	}
+	if (fwrite(buf, h.fileSize, 1, f) != 1 || fflush(f) != 0 || fsync(fileno(f)) < 0) {
+		fprintf(stderr, "Can't write %s: %s\n", tmp, strerror(errno));
+		goto error;
+	}
+	if (fclose(f) != 0) {
+		f = NULL;
+		fprintf(stderr, "Can't write %s: %s\n", tmp, strerror(errno));
+		goto error;
+	}
+	f = NULL;
+	if (rename(tmp, path) < 0) {
+		fprintf(stderr, "Can't rename %s to %s: %s\n", tmp, path, strerror(errno));
+		goto error;
+	}
+
+	free(tmp);
+	free(index);
+	free(buf);
+
+	return 0;
+
+error:
+
+	if (f) {
+		fclose(f);
+	}
+	if (tmp) {
+		unlink(tmp);
+		free(tmp);
+	}
+	free(index);
+	free(buf);
+	return -1;
+}
+
+/*
+ * Check that every point's node and every node's name are inside the
+ * file.
+ */
+static int
+mappedValid(const uint8_t *map, const MappedHeader *h)
+{
+	const uint32_t *nodeIndex = (const uint32_t *)(map + h->nodeIndexOffset);
+	const MappedNode *nodes = (const MappedNode *)(map + h->nodesOffset);
+	uint64_t namesSize = h->fileSize - h->namesOffset;
+	uint64_t i;
+
+	for (i = 0; i < h->numPoints; i++) {
+		if (nodeIndex[i] >= h->numNodes) {
+			return 0;
+		}
+	}
+
+	for (i = 0; i < h->numNodes; i++) {
+		if (nodes[i].nameOffset >= namesSize) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+MappedCircle *
+circleOpenMapped(const char *path, hashFunction hashFunc, int verify)
+{
+	MappedCircle *m;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "Can't stat %s: %s\n", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < sizeof(MappedHeader)) {
+		fprintf(stderr, "%s is too small to be a circle snapshot\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Can't mmap %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	/*
+	 * Check the header describes a file of exactly this size with every
+	 * section inside it and the names terminated. If asked to, check the
+	 * checksum and that the sections only point inside the file, which
+	 * reads all of it.
+	 */
+	const MappedHeader *h = map;
+	const char *why = NULL;
+	if (memcmp(h->magic, MAPPED_CIRCLE_MAGIC, sizeof(h->magic)) != 0) {
+		why = "bad magic";
+	} else if (h->version != MAPPED_CIRCLE_VERSION) {
+		why = "unsupported version";
+	} else if (h->headerSize != sizeof(*h) || h->fileSize != st.st_size) {
+		why = "bad size";
+	} else if (h->hashesOffset < sizeof(*h) || h->hashesOffset > h->fileSize ||
+		h->numPoints > (h->fileSize - h->hashesOffset) / sizeof(uint64_t) ||
+		h->nodeIndexOffset != h->hashesOffset + h->numPoints * sizeof(uint64_t) ||
+		h->nodesOffset < h->nodeIndexOffset + h->numPoints * sizeof(uint32_t) ||
+		h->nodesOffset > h->fileSize ||
+		h->numNodes > (h->fileSize - h->nodesOffset) / sizeof(MappedNode) ||
+		h->namesOffset != h->nodesOffset + h->numNodes * sizeof(MappedNode) ||
+		h->namesOffset > h->fileSize ||
+		h->hashesOffset % 8 || h->nodesOffset % 8) {
+		why = "bad section offsets";
+	} else if (h->numNodes > 0 &&
+		(h->namesOffset == h->fileSize || ((const char *)map)[h->fileSize - 1] != '\0')) {
+		/*
+		 * The file ends with a NUL, so every name that starts inside the
+		 * names section is terminated.
+		 */
+		why = "unterminated names";
+	} else if (verify && h->checksum != checksum((uint8_t *)map + sizeof(*h), h->fileSize - sizeof(*h))) {
+		why = "bad checksum";
+	} else if (verify && !mappedValid(map, h)) {
+		why = "bad nodes";
+	}
+	if (why) {
+		fprintf(stderr, "Can't use %s: %s\n", path, why);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL) {
+		fprintf(stderr, "Can't alloc mapped circle: %s\n", strerror(errno));
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	m->map = map;
+	m->mapSize = st.st_size;
+	m->hashes = (const uint64_t *)((uint8_t *)map + h->hashesOffset);
+	m->nodeIndex = (const uint32_t *)((uint8_t *)map + h->nodeIndexOffset);
+	m->nodes = (const MappedNode *)((uint8_t *)map + h->nodesOffset);
+	m->names = (const char *)map + h->namesOffset;
+	m->namesSize = h->fileSize - h->namesOffset;
+	m->numPoints = h->numPoints;
+	m->numNodes = h->numNodes;
+	m->hashFunc = hashFunc ? hashFunc : wyHash;
+
+	return m;
+}
+
+const MappedNode *
+mappedClosestNode(MappedCircle *m, char *key)
+{
+	if (m->numPoints == 0) {
+		return NULL;
+	}
+
+	uint64_t i = circleSearch(m->hashes, m->numPoints, m->hashFunc(key, strlen(key)));
+	if (i == m->numPoints) {
+		i = 0;
+	}
+
+	/*
+	 * An unverified snapshot may hold any node index.
+	 */
+	uint64_t n = m->nodeIndex[i];
+	if (n >= m->numNodes) {
+		return m->numNodes > 0 ? m->nodes + m->numNodes - 1 : NULL;
+	}
+	return m->nodes + n;
+}
+
+const char *
+mappedNodeName(MappedCircle *m, const MappedNode *n)
+{
+	if (n->nameOffset >= m->namesSize) {
+		return m->names + m->namesSize - 1;
+	}
+	return m->names + n->nameOffset;
+}
+
+void
+circleCloseMapped(MappedCircle **m)
+{
+	if (m == NULL || *m == NULL) {
+		return;
+	}
+
+	munmap((*m)->map, (*m)->mapSize);
+	free(*m);
+	*m = NULL;
+}
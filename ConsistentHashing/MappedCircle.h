@@ -0,0 +1,103 @@
+#ifndef __MAPPED_CIRCLE_H
+#define __MAPPED_CIRCLE_H
+
+#include <inttypes.h>
+
+#include "HashCircle.h"
+
+/*
+ * On-disk snapshot of a built Circle that is served straight from an
+ * mmap()ed file.
+ *
+ * All fields are in host byte order and every section is 8-byte aligned:
+ *
+ *   MappedHeader
+ *   uint64_t hashes[numPoints]        sorted point hashes
+ *   uint32_t nodeIndex[numPoints]     node of each point
+ *   MappedNode nodes[numNodes]
+ *   char names[]                      NUL terminated node names
+ */
+
+#define MAPPED_CIRCLE_MAGIC "HCIRCLE"
+#define MAPPED_CIRCLE_VERSION 1
+
+typedef struct MappedHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize;
+	uint64_t fileSize;
+
+	uint64_t numPoints;
+	uint64_t numNodes;
+
+	uint64_t hashesOffset;
+	uint64_t nodeIndexOffset;
+	uint64_t nodesOffset;
+	uint64_t namesOffset;
+
+	/*
+	 * Checksum of everything after the header.
+	 */
+	uint64_t checksum;
+} MappedHeader;
+
+typedef struct MappedNode {
+	/*
+	 * Offset of the name in the names section.
+	 */
+	uint64_t nameOffset;
+	uint64_t weight;
+} MappedNode;
+
+typedef struct MappedCircle {
+	void *map;
+	uint64_t mapSize;
+
+	const uint64_t *hashes;
+	const uint32_t *nodeIndex;
+	const MappedNode *nodes;
+	const char *names;
+	uint64_t namesSize;
+	uint64_t numPoints;
+	uint64_t numNodes;
+
+	hashFunction hashFunc;
+} MappedCircle;
+
+/*
+ * Write the Circle to 'path'. The file is written next to 'path' and
+ * renamed into place, so readers never see a partial snapshot.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned.
+ */
+int circleSave(Circle *c, const char *path);
+
+/*
+ * Map the snapshot at 'path' read-only. Nothing is copied or rebuilt:
+ * opening only checks the header and lookups search the mapped hashes
+ * directly. 'hashFunc' must be the hash function of the saved Circle, or
+ * NULL for the built-in default.
+ *
+ * If 'verify' is set, the checksum and every point's node and node's name
+ * are checked too, which reads the whole file. Without it, lookups in a
+ * corrupt snapshot stay inside the mapping but may return the wrong node.
+ *
+ * On success, a pointer to the MappedCircle is returned.
+ * On error, NULL is returned.
+ */
+MappedCircle *circleOpenMapped(const char *path, hashFunction hashFunc, int verify);
+
+/*
+ * The mapped equivalent of circleClosestPoint(): find the node that 'key'
+ * maps to.
+ *
+ * Returns NULL if the snapshot has no points.
+ */
+const MappedNode *mappedClosestNode(MappedCircle *m, char *key);
+
+const char *mappedNodeName(MappedCircle *m, const MappedNode *n);
+
+void circleCloseMapped(MappedCircle **m);
+
+#endif /* __MAPPED_CIRCLE_H */
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "Rendezvous.h"
+#include "FastHash.h"
+
+/*
+ * Nodes scored per vector, and per chunk of scores kept on the stack.
+ */
+#define LANES 4
+#define CHUNK 64
+
+typedef uint64_t u64x4 __attribute__((vector_size(LANES * sizeof(uint64_t))));
+
+Rendezvous *
+rendezvousAlloc(hashFunction hashFunc)
+{
+	Rendezvous *r;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		fprintf(stderr, "Can't alloc rendezvous: %s\n", strerror(errno));
+		return NULL;
+	}
+	r->hashFunc = hashFunc ? hashFunc : wyHash;
+
+	return r;
+}
+
+int
+rendezvousBuild(Rendezvous *r, Node *nodes)
+{
+	uint64_t numNodes = 0;
+	Node *n;
+
+	for (n = nodes; n; n = n->next) {
+		numNodes++;
+	}
+
+	/*
+	 * Pad the arrays to a whole number of vectors.
+	 */
+	uint64_t padded = (numNodes + LANES - 1) / LANES * LANES;
+	if (padded == 0) {
+		padded = LANES;
+	}
+
+	uint64_t *seeds = aligned_alloc(sizeof(u64x4), padded * sizeof(*seeds));
+	double *weights = aligned_alloc(sizeof(u64x4), padded * sizeof(*weights));
+	Node **list = malloc(padded * sizeof(*list));
+	if (seeds == NULL || weights == NULL || list == NULL) {
+		fprintf(stderr, "Can't alloc rendezvous nodes: %s\n", strerror(errno));
+		free(seeds);
+		free(weights);
+		free(list);
+		return -1;
+	}
+
+	uint64_t i;
+	int weighted = 0;
+	for (n = nodes, i = 0; n; n = n->next, i++) {
+		seeds[i] = r->hashFunc(n->name, strlen(n->name));
+		weights[i] = n->weight;
+		list[i] = n;
+		if (n->weight != nodes->weight) {
+			weighted = 1;
+		}
+	}
+	for (; i < padded; i++) {
+		seeds[i] = 0;
+		weights[i] = 0;
+		list[i] = NULL;
+	}
+
+	free(r->seeds);
+	free(r->weights);
+	free(r->nodes);
+	r->seeds = seeds;
+	r->weights = weights;
+	r->nodes = list;
+	r->numNodes = numNodes;
+	r->weighted = weighted;
+
+	return 0;
+}
+
+/*
+ * Score nodes [first, first + num) for the key hash 'h' into 'score';
+ * higher is better. 'first' and 'num' are multiples of LANES.
+ */
+static void
+scoreNodes(Rendezvous *r, uint64_t h, uint64_t first, uint64_t num, double *score)
+{
+	uint64_t raw[CHUNK] __attribute__((aligned(sizeof(u64x4))));
+	uint64_t i;
+
+	/*
+	 * Mix the key hash with every seed, a vector at a time (the murmur3
+	 * 64-bit finalizer).
+	 */
+	for (i = 0; i < num; i += LANES) {
+		u64x4 x = *(u64x4 *)(r->seeds + first + i) ^ h;
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		*(u64x4 *)(raw + i) = x;
+	}
+
+	const double *w = r->weights + first;
+	if (r->weighted) {
+		for (i = 0; i < num; i++) {
+			double u = ((int64_t)(raw[i] >> 11) + 0.5) * 0x1p-53;
+			score[i] = w[i] > 0 ? -w[i] / log(u) : -INFINITY;
+		}
+	} else {
+		for (i = 0; i < num; i++) {
+			score[i] = w[i] > 0 ? (double)(int64_t)(raw[i] >> 11) : -INFINITY;
+		}
+	}
+}
+
+int
+rendezvousTopK(Rendezvous *r, char *key, int k, Node **out)
+{
+	double score[CHUNK];
+	uint64_t first, i;
+	int count = 0;
+
+	if (k <= 0 || r->numNodes == 0) {
+		return 0;
+	}
+
+	/*
+	 * There are never more than numNodes to return, which also bounds the
+	 * stack the scores take.
+	 */
+	if ((uint64_t)k > r->numNodes) {
+		k = r->numNodes;
+	}
+	double best[k];
+
+	uint64_t h = r->hashFunc(key, strlen(key));
+	uint64_t padded = (r->numNodes + LANES - 1) / LANES * LANES;
+
+	for (first = 0; first < padded; first += CHUNK) {
+		uint64_t num = padded - first < CHUNK ? padded - first : CHUNK;
+		scoreNodes(r, h, first, num, score);
+
+		/*
+		 * Keep the best 'k' in order with an insertion sort.
+		 */
+		for (i = 0; i < num; i++) {
+			if (score[i] == -INFINITY || (count == k && score[i] <= best[k - 1])) {
+				continue;
+			}
+
+			int j = count < k ? count++ : k - 1;
+			for (; j > 0 && best[j - 1] < score[i]; j--) {
+				best[j] = best[j - 1];
+				out[j] = out[j - 1];
+			}
+			best[j] = score[i];
+			out[j] = r->nodes[first + i];
+		}
+	}
+
+	return count;
+}
+
+Node *
+rendezvousLookup(Rendezvous *r, char *key)
+{
+	Node *n;
+
+	if (rendezvousTopK(r, key, 1, &n) == 0) {
+		return NULL;
+	}
+	return n;
+}
+
+void
+rendezvousFree(Rendezvous **r)
+{
+	if (r == NULL || *r == NULL) {
+		return;
+	}
+
+	free((*r)->seeds);
+	free((*r)->weights);
+	free((*r)->nodes);
+	free(*r);
+	*r = NULL;
+}
@@ -0,0 +1,71 @@
+#ifndef __RENDEZVOUS_H
+#define __RENDEZVOUS_H
+
+#include <inttypes.h>
+
+#include "HashCircle.h"
+
+/*
+ * Rendezvous (highest random weight) hashing.
+ *
+ * A key goes to the node with the highest score, where each node's score
+ * is a hash of the key mixed with that node's seed. There are no virtual
+ * points and the spread is ideal, but a lookup scores every node, so it
+ * suits small pools. Seeds are kept in an aligned array and scored a
+ * vector at a time.
+ *
+ * With unequal weights, node i scores -weight_i / ln(u_i), where u_i is
+ * its hash mapped into (0, 1). That gives every node a share of the keys
+ * proportional to its weight.
+ */
+typedef struct Rendezvous {
+	uint64_t *seeds;
+	double *weights;
+	Node **nodes;
+	uint64_t numNodes;
+
+	/*
+	 * Set if the nodes don't all have the same weight.
+	 */
+	int weighted;
+
+	hashFunction hashFunc;
+} Rendezvous;
+
+/*
+ * Allocate a new Rendezvous handle. A NULL 'hashFunc' picks the built-in
+ * default.
+ *
+ * On success, a pointer to the new handle is returned.
+ * On error, NULL is returned.
+ */
+Rendezvous *rendezvousAlloc(hashFunction hashFunc);
+
+/*
+ * (Re)build from the linked list of 'nodes', usually the 'nodes' list of
+ * a Circle. Nodes with a weight of 0 never win.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and the handle is left unchanged.
+ */
+int rendezvousBuild(Rendezvous *r, Node *nodes);
+
+/*
+ * Find the node 'key' maps to.
+ *
+ * Returns NULL if there are no nodes with a weight.
+ */
+Node *rendezvousLookup(Rendezvous *r, char *key);
+
+/*
+ * Find the 'k' highest scoring nodes for 'key', best first, and store
+ * them in 'out'. The first is the node rendezvousLookup() returns, and
+ * the list is the preference list for replicating 'key' to 'k' nodes.
+ *
+ * Returns the number of nodes stored.
+ */
+int rendezvousTopK(Rendezvous *r, char *key, int k, Node **out);
+
+void rendezvousFree(Rendezvous **r);
+
+#endif /* __RENDEZVOUS_H */
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "SharedCircle.h"
+
+static CircleSnapshot *
+snapshotAlloc(Circle *c)
+{
+	CircleSnapshot *snap;
+
+	snap = calloc(1, sizeof(*snap));
+	if (snap == NULL) {
+		fprintf(stderr, "Can't alloc snapshot: %s\n", strerror(errno));
+		return NULL;
+	}
+	snap->circle = c;
+	atomic_init(&snap->refs, 1);
+
+	return snap;
+}
+
+SharedCircle *
+sharedCircleAlloc(Circle *c)
+{
+	SharedCircle *s;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		fprintf(stderr, "Can't alloc shared circle: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	CircleSnapshot *snap = snapshotAlloc(c);
+	if (snap == NULL) {
+		free(s);
+		return NULL;
+	}
+
+	atomic_init(&s->current, snap);
+	atomic_init(&s->epoch, 1);
+	pthread_mutex_init(&s->lock, NULL);
+
+	return s;
+}
+
+void
+sharedCircleRelease(CircleSnapshot *snap)
+{
+	if (atomic_fetch_sub(&snap->refs, 1) == 1) {
+		circleFree(&snap->circle);
+		free(snap);
+	}
+}
+
+/*
+ * Drop the SharedCircle's reference to every retired snapshot whose grace
+ * period has ended: no reader is still inside a read section it entered
+ * before the snapshot was replaced.
+ *
+ * Must be called with the lock held. Returns the number of snapshots still
+ * waiting.
+ */
+static int
+reclaim(SharedCircle *s)
+{
+	uint64_t oldest = UINT64_MAX;
+	CircleReader *r;
+
+	for (r = s->readers; r; r = r->next) {
+		uint64_t e = atomic_load(&r->epoch);
+		if (e != 0 && e < oldest) {
+			oldest = e;
+		}
+	}
+
+	int waiting = 0;
+	CircleSnapshot **p = &s->retired;
+	while (*p) {
+		CircleSnapshot *snap = *p;
+		if (snap->retired <= oldest) {
+			*p = snap->next;
+			sharedCircleRelease(snap);
+		} else {
+			p = &snap->next;
+			waiting++;
+		}
+	}
+
+	return waiting;
+}
+
+void
+sharedCircleFree(SharedCircle **s)
+{
+	if (s == NULL || *s == NULL) {
+		return;
+	}
+
+	while ((*s)->retired) {
+		CircleSnapshot *snap = (*s)->retired;
+		(*s)->retired = snap->next;
+		sharedCircleRelease(snap);
+	}
+	sharedCircleRelease(atomic_load(&(*s)->current));
+
+	pthread_mutex_destroy(&(*s)->lock);
+	free(*s);
+	*s = NULL;
+}
+
+CircleReader *
+sharedCircleRegister(SharedCircle *s)
+{
+	CircleReader *r;
+
+	r = aligned_alloc(_Alignof(CircleReader), sizeof(*r));
+	if (r == NULL) {
+		fprintf(stderr, "Can't alloc reader: %s\n", strerror(errno));
+		return NULL;
+	}
+	atomic_init(&r->epoch, 0);
+	r->shared = s;
+
+	pthread_mutex_lock(&s->lock);
+	r->next = s->readers;
+	s->readers = r;
+	pthread_mutex_unlock(&s->lock);
+
+	return r;
+}
+
+void
+sharedCircleUnregister(CircleReader **r)
+{
+	if (r == NULL || *r == NULL) {
+		return;
+	}
+
+	SharedCircle *s = (*r)->shared;
+
+	pthread_mutex_lock(&s->lock);
+	CircleReader **p;
+	for (p = &s->readers; *p; p = &(*p)->next) {
+		if (*p == *r) {
+			*p = (*r)->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	free(*r);
+	*r = NULL;
+}
+
+Circle *
+sharedCircleReadBegin(CircleReader *r)
+{
+	SharedCircle *s = r->shared;
+
+	/*
+	 * Announce the epoch before loading the snapshot. A writer that sees
+	 * this reader idle, or in an epoch after a snapshot was replaced, knows
+	 * the reader can only load the replacement or something newer.
+	 */
+	atomic_store(&r->epoch, atomic_load(&s->epoch));
+
+	return atomic_load(&s->current)->circle;
+}
+
+void
+sharedCircleReadEnd(CircleReader *r)
+{
+	atomic_store_explicit(&r->epoch, 0, memory_order_release);
+}
+
+CircleSnapshot *
+sharedCircleAcquire(CircleReader *r)
+{
+	SharedCircle *s = r->shared;
+
+	/*
+	 * Inside a read section the current snapshot is already safe to load,
+	 * and the section must stay open for the caller.
+	 */
+	uint_fast64_t outer = atomic_load_explicit(&r->epoch, memory_order_relaxed);
+	if (outer == 0) {
+		atomic_store(&r->epoch, atomic_load(&s->epoch));
+	}
+	CircleSnapshot *snap = atomic_load(&s->current);
+	atomic_fetch_add(&snap->refs, 1);
+	if (outer == 0) {
+		sharedCircleReadEnd(r);
+	}
+
+	return snap;
+}
+
+Circle *
+sharedCircleUpdateBegin(SharedCircle *s)
+{
+	pthread_mutex_lock(&s->lock);
+
+	Circle *next = circleClone(atomic_load(&s->current)->circle);
+	if (next == NULL) {
+		pthread_mutex_unlock(&s->lock);
+		return NULL;
+	}
+
+	return next;
+}
+
+int
+sharedCircleUpdateCommit(SharedCircle *s, Circle *next)
+{
+	CircleSnapshot *snap = snapshotAlloc(next);
+	if (snap == NULL) {
+		sharedCircleUpdateAbort(s, next);
+		return -1;
+	}
+
+	CircleSnapshot *old = atomic_exchange(&s->current, snap);
+	old->retired = atomic_fetch_add(&s->epoch, 1) + 1;
+	old->next = s->retired;
+	s->retired = old;
+
+	reclaim(s);
+
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+}
+
+void
+sharedCircleUpdateAbort(SharedCircle *s, Circle *next)
+{
+	circleFree(&next);
+	pthread_mutex_unlock(&s->lock);
+}
+
+void
+sharedCircleSynchronize(SharedCircle *s)
+{
+	pthread_mutex_lock(&s->lock);
+	while (reclaim(s) > 0) {
+		sched_yield();
+	}
+	pthread_mutex_unlock(&s->lock);
+}
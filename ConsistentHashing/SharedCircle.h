@@ -0,0 +1,133 @@
+#ifndef __SHARED_CIRCLE_H
+#define __SHARED_CIRCLE_H
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "HashCircle.h"
+
+/*
+ * A Circle shared between many reader threads and serialized writers.
+ *
+ * Readers look up keys in an immutable snapshot of the Circle and never
+ * take a lock or write to a cache line shared with other readers. Writers
+ * change a private copy of the current snapshot and publish it with an
+ * atomic pointer swap. The replaced snapshot is freed once every reader
+ * that might still be using it has finished (a grace period).
+ */
+
+typedef struct CircleSnapshot {
+	Circle *circle;
+
+	/*
+	 * One reference is held by the SharedCircle until the snapshot's
+	 * grace period ends, the rest by sharedCircleAcquire() callers.
+	 */
+	atomic_uint_fast64_t refs;
+
+	/*
+	 * The epoch the snapshot was replaced in.
+	 */
+	uint64_t retired;
+	struct CircleSnapshot *next;
+} CircleSnapshot;
+
+typedef struct CircleReader {
+	/*
+	 * The epoch the reader entered its read section in, or 0 if it is
+	 * not reading. Only ever written by its own thread.
+	 */
+	_Alignas(64) atomic_uint_fast64_t epoch;
+
+	struct SharedCircle *shared;
+	struct CircleReader *next;
+} CircleReader;
+
+typedef struct SharedCircle {
+	_Atomic(CircleSnapshot *) current;
+	atomic_uint_fast64_t epoch;
+
+	/*
+	 * Serializes writers and reader (un)registration.
+	 */
+	pthread_mutex_t lock;
+
+	CircleReader *readers;
+	CircleSnapshot *retired;
+} SharedCircle;
+
+/*
+ * Allocate a new SharedCircle handle, publishing 'c' as the first snapshot.
+ * The SharedCircle takes ownership of 'c'.
+ *
+ * On success, a pointer to the new handle is returned.
+ * On error, NULL is returned.
+ */
+SharedCircle *sharedCircleAlloc(Circle *c);
+
+/*
+ * Free the SharedCircle and all of its snapshots. No readers may be
+ * registered and no acquired snapshots may be outstanding.
+ */
+void sharedCircleFree(SharedCircle **s);
+
+/*
+ * Register the calling thread as a reader. Each reader thread needs its
+ * own handle.
+ *
+ * On success, a pointer to the reader handle is returned.
+ * On error, NULL is returned.
+ */
+CircleReader *sharedCircleRegister(SharedCircle *s);
+void sharedCircleUnregister(CircleReader **r);
+
+/*
+ * Enter a read section and return the current snapshot. The Circle stays
+ * valid, and must not be changed, until sharedCircleReadEnd(). Read
+ * sections do not nest.
+ */
+Circle *sharedCircleReadBegin(CircleReader *r);
+void sharedCircleReadEnd(CircleReader *r);
+
+/*
+ * Take a reference to the current snapshot so it can be used outside of a
+ * read section. Drop it with sharedCircleRelease(). Called inside a read
+ * section, the section stays open.
+ */
+CircleSnapshot *sharedCircleAcquire(CircleReader *r);
+void sharedCircleRelease(CircleSnapshot *snap);
+
+/*
+ * Start an update. Returns a private copy of the current snapshot that
+ * may be changed with the normal Circle functions (use circleFindNode()
+ * to find a node in the copy). Other writers wait until the update is
+ * committed or aborted.
+ *
+ * On success, a pointer to the copy is returned.
+ * On error, NULL is returned and no update is in progress.
+ */
+Circle *sharedCircleUpdateBegin(SharedCircle *s);
+
+/*
+ * Publish 'next' as the current snapshot and end the update. The old
+ * snapshot is freed once its grace period ends, without waiting for it
+ * here.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and the update is aborted.
+ */
+int sharedCircleUpdateCommit(SharedCircle *s, Circle *next);
+
+/*
+ * Throw away 'next' and end the update.
+ */
+void sharedCircleUpdateAbort(SharedCircle *s, Circle *next);
+
+/*
+ * Wait until every replaced snapshot's grace period has ended and free
+ * them.
+ */
+void sharedCircleSynchronize(SharedCircle *s);
+
+#endif /* __SHARED_CIRCLE_H */
@@ -0,0 +1,419 @@
+#include "HashCircle.h"
+#include "FastHash.h"
+#include "MappedCircle.h"
+#include "Rendezvous.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * FNV-1a with a final avalanche so short keys spread over the whole ring.
+ */
+static uint64_t
+benchHash(void *key, uint64_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint64_t i;
+	for (i = 0; i < len; i++) {
+		hash ^= ((uint8_t *)key)[i];
+		hash *= 0x100000001b3ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Circle *
+benchCircle(int numNodes, int weight)
+{
+	char **names = malloc(numNodes * sizeof(*names));
+	int *weights = malloc(numNodes * sizeof(*weights));
+	int i;
+	for (i = 0; i < numNodes; i++) {
+		names[i] = malloc(32);
+		snprintf(names[i], 32, "node%d", i);
+		weights[i] = weight;
+	}
+
+	/*
+	 * The Circle keeps pointers to the names, so they are never freed.
+	 */
+	Circle *c = circleBuild(wyHash, names, NULL, weights, numNodes);
+	free(weights);
+	free(names);
+	return c;
+}
+
+static char **
+benchKeys(size_t numKeys)
+{
+	char **keys = malloc(numKeys * sizeof(*keys));
+	size_t i;
+	for (i = 0; i < numKeys; i++) {
+		keys[i] = malloc(32);
+		snprintf(keys[i], 32, "key-%zu", i);
+	}
+	return keys;
+}
+
+static void
+benchLookup(int numNodes, int weight, char **keys, size_t numKeys)
+{
+	Circle *c = benchCircle(numNodes, weight);
+	Point **scalar = malloc(numKeys * sizeof(*scalar));
+	Point **batch = malloc(numKeys * sizeof(*batch));
+	size_t i;
+
+	double start = now();
+	for (i = 0; i < numKeys; i++) {
+		scalar[i] = circleClosestPoint(c, keys[i]);
+	}
+	double scalarTime = now() - start;
+
+	start = now();
+	circleClosestPointBatch(c, keys, numKeys, batch);
+	double batchTime = now() - start;
+
+	for (i = 0; i < numKeys; i++) {
+		if (scalar[i] != batch[i]) {
+			fprintf(stderr, "Batch lookup of %s differs!\n", keys[i]);
+			abort();
+		}
+	}
+
+	printf("%10" PRIu64 " points: scalar %7.1f ns/key, batch %7.1f ns/key (%.2fx)\n",
+			c->numPoints, scalarTime * 1e9 / numKeys, batchTime * 1e9 / numKeys,
+			scalarTime / batchTime);
+
+	free(scalar);
+	free(batch);
+	circleFree(&c);
+}
+
+static void
+benchBuild(int numNodes, int weight)
+{
+	double start = now();
+	Circle *c = benchCircle(numNodes, weight);
+	double elapsed = now() - start;
+
+	printf("%5d nodes x %4d weight: %10" PRIu64 " points in %7.3f s, %6.1f M points/s\n",
+			numNodes, weight, c->numPoints, elapsed, c->numPoints / elapsed / 1e6);
+
+	circleFree(&c);
+}
+
+static void
+benchMapped(int numNodes, int weight)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/hashcircle-bench-%d.snap", (int)getpid());
+
+	double start = now();
+	Circle *c = benchCircle(numNodes, weight);
+	double buildTime = now() - start;
+
+	if (circleSave(c, path) < 0) {
+		abort();
+	}
+
+	start = now();
+	MappedCircle *m = circleOpenMapped(path, NULL, 0);
+	double openTime = now() - start;
+	if (m == NULL || mappedClosestNode(m, "key") == NULL) {
+		abort();
+	}
+	circleCloseMapped(&m);
+
+	start = now();
+	m = circleOpenMapped(path, NULL, 1);
+	double verifyTime = now() - start;
+	if (m == NULL) {
+		abort();
+	}
+
+	printf("%10" PRIu64 " points: build %7.3f s, open mapped %9.6f s (%.0fx), verified %7.3f s (%.0fx)\n",
+			c->numPoints, buildTime, openTime, buildTime / openTime,
+			verifyTime, buildTime / verifyTime);
+
+	circleCloseMapped(&m);
+	unlink(path);
+	circleFree(&c);
+}
+
+static void
+benchRendezvous(int numNodes, int weight, char **keys, size_t numKeys)
+{
+	Circle *c = benchCircle(numNodes, weight);
+	Rendezvous *r = rendezvousAlloc(NULL);
+	rendezvousBuild(r, c->nodes);
+	uintptr_t sum = 0;
+	size_t i;
+
+	double start = now();
+	for (i = 0; i < numKeys; i++) {
+		sum += (uintptr_t)circleClosestPoint(c, keys[i])->node;
+	}
+	double circleTime = now() - start;
+
+	start = now();
+	for (i = 0; i < numKeys; i++) {
+		sum += (uintptr_t)rendezvousLookup(r, keys[i]);
+	}
+	double hrwTime = now() - start;
+
+	Node *n = circleNextPoint(c, c->points)->node;
+	circleReweight(c, n, n->weight + 1);
+	rendezvousBuild(r, c->nodes);
+	start = now();
+	for (i = 0; i < numKeys; i++) {
+		sum += (uintptr_t)rendezvousLookup(r, keys[i]);
+	}
+	double weightedTime = now() - start;
+
+	printf("%3d nodes: circle (weight %d) %6.1f ns/key, rendezvous %6.1f ns/key, weighted %6.1f ns/key (%" PRIxPTR ")\n",
+			numNodes, weight, circleTime * 1e9 / numKeys, hrwTime * 1e9 / numKeys,
+			weightedTime * 1e9 / numKeys, sum & 0xf);
+
+	rendezvousFree(&r);
+	circleFree(&c);
+}
+
+static void
+benchPrefix(int numNodes, int weight, char **keys, size_t numKeys)
+{
+	Circle *c = benchCircle(numNodes, weight);
+	int bits[] = {0, 12, 16, 20};
+	uintptr_t sum = 0;
+	size_t i;
+	int b;
+
+	printf("%10" PRIu64 " points:", c->numPoints);
+	for (b = 0; b < sizeof(bits) / sizeof(*bits); b++) {
+		circleSetPrefixBits(c, bits[b]);
+
+		/*
+		 * Warm up so every setting starts with the same cache state.
+		 */
+		for (i = 0; i < numKeys; i++) {
+			sum += (uintptr_t)circleClosestPoint(c, keys[i]);
+		}
+
+		double start = now();
+		for (i = 0; i < numKeys; i++) {
+			sum += (uintptr_t)circleClosestPoint(c, keys[i]);
+		}
+		double elapsed = now() - start;
+
+		/*
+		 * Average number of hashes the binary search starts with.
+		 */
+		double range = c->numPoints;
+		if (c->prefix) {
+			range = (double)c->numPoints / (1ULL << c->prefixBits);
+		}
+
+		printf("  %2d bits %6.1f ns/key (~%.1f probes)", bits[b], elapsed * 1e9 / numKeys,
+				range > 1 ? log2(range) + 1 : 1);
+	}
+	printf(" (%" PRIxPTR ")\n", sum & 0xf);
+
+	circleFree(&c);
+}
+
+/*
+ * Look up 'numKeys' keys and return the largest node load over the mean.
+ */
+static double
+benchPeakToMean(Circle *c, int numNodes, char **keys, size_t numKeys, int k)
+{
+	uint64_t *load = calloc(numNodes, sizeof(*load));
+	uint64_t peak = 0;
+	size_t i;
+
+	for (i = 0; i < numKeys; i++) {
+		Point *p = k ? circleMultiProbePoint(c, keys[i], k) : circleClosestPoint(c, keys[i]);
+		load[strtol(p->node->name + 4, NULL, 10)]++;
+	}
+	for (i = 0; i < numNodes; i++) {
+		if (load[i] > peak) {
+			peak = load[i];
+		}
+	}
+	free(load);
+
+	return (double)peak * numNodes / numKeys;
+}
+
+static void
+benchMultiProbe(int numNodes, char **keys, size_t numKeys)
+{
+	/*
+	 * Bytes per point: the Point itself, its hash index entry and its
+	 * next-distinct index entry.
+	 */
+	size_t pointBytes = sizeof(Point) + 2 * sizeof(uint64_t);
+	int weights[] = {1, 10, 100, 1000};
+	int probes[] = {1, 5, 21, 50};
+	int i;
+
+	for (i = 0; i < sizeof(weights) / sizeof(*weights); i++) {
+		Circle *c = benchCircle(numNodes, weights[i]);
+		double start = now();
+		double ratio = benchPeakToMean(c, numNodes, keys, numKeys, 0);
+		double elapsed = now() - start;
+		printf("ring        weight %4d: peak/mean %5.2f, %9zu bytes, %6.1f ns/key\n",
+				weights[i], ratio, c->numPoints * pointBytes, elapsed * 1e9 / numKeys);
+		circleFree(&c);
+	}
+
+	Circle *c = benchCircle(numNodes, 1);
+	for (i = 0; i < sizeof(probes) / sizeof(*probes); i++) {
+		double start = now();
+		double ratio = benchPeakToMean(c, numNodes, keys, numKeys, probes[i]);
+		double elapsed = now() - start;
+		printf("multi-probe k=%2d        : peak/mean %5.2f, %9zu bytes, %6.1f ns/key\n",
+				probes[i], ratio, c->numPoints * pointBytes, elapsed * 1e9 / numKeys);
+	}
+	circleFree(&c);
+}
+
+/*
+ * The first 'n' distinct nodes the slow way, one point at a time.
+ */
+static int
+benchReplicasWalk(Circle *c, char *key, int n, Node **out)
+{
+	Point *start = circleClosestPoint(c, key);
+	Point *p = start;
+	int count = 0;
+
+	do {
+		int j;
+		for (j = 0; j < count && out[j] != p->node; j++);
+		if (j == count) {
+			out[count++] = p->node;
+		}
+	} while (count < n && (p = circleNextPoint(c, p)) != start);
+
+	return count;
+}
+
+static void
+benchReplicas(int numNodes, int weight, int n, char **keys, size_t numKeys)
+{
+	Circle *c = benchCircle(numNodes, weight);
+	Node **out = malloc(n * sizeof(*out));
+	uintptr_t sum = 0;
+	size_t i;
+
+	double start = now();
+	for (i = 0; i < numKeys; i++) {
+		sum += benchReplicasWalk(c, keys[i], n, out);
+	}
+	double walkTime = now() - start;
+
+	start = now();
+	for (i = 0; i < numKeys; i++) {
+		sum += circleReplicas(c, keys[i], n, out);
+	}
+	double runTime = now() - start;
+
+	circleSetReplicaDepth(c, n);
+	start = now();
+	for (i = 0; i < numKeys; i++) {
+		sum += circleReplicas(c, keys[i], n, out);
+	}
+	double indexTime = now() - start;
+
+	printf("%4d nodes x %4d weight, n=%3d: walk %8.1f ns/key, skip runs %7.1f ns/key, "
+			"index %5.1f ns/key (%" PRIxPTR ")\n",
+			numNodes, weight, n, walkTime * 1e9 / numKeys, runTime * 1e9 / numKeys,
+			indexTime * 1e9 / numKeys, sum & 0xf);
+
+	free(out);
+	circleFree(&c);
+}
+
+static void
+benchHashFunc(char *name, hashFunction hashFunc, char **keys, size_t numKeys)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	double start = now();
+	for (i = 0; i < numKeys; i++) {
+		sum += hashFunc(keys[i], strlen(keys[i]));
+	}
+	double elapsed = now() - start;
+
+	printf("%-8s %5.1f ns/key (%" PRIx64 ")\n", name, elapsed * 1e9 / numKeys, sum);
+}
+
+int main()
+{
+	size_t numKeys = 1000000;
+	char **keys = benchKeys(numKeys);
+
+	printf("Ring construction\n");
+	benchBuild(500, 200);
+	benchBuild(5000, 200);
+	benchBuild(1000, 1000);
+	printf("\n");
+
+	printf("Startup: circleBuild vs circleOpenMapped\n");
+	benchMapped(500, 200);
+	benchMapped(1000, 1000);
+	printf("\n");
+
+	printf("circleClosestPoint with a prefix table, %zu keys\n", numKeys);
+	benchPrefix(100, 100, keys, numKeys);
+	benchPrefix(1000, 1000, keys, numKeys);
+	benchPrefix(5000, 1000, keys, numKeys);
+	printf("\n");
+
+	printf("circleReplicas vs a circleNextPoint walk, %zu keys\n", numKeys / 10);
+	benchReplicas(100, 100, 3, keys, numKeys / 10);
+	benchReplicas(100, 100, 50, keys, numKeys / 10);
+	benchReplicas(100, 100, 100, keys, numKeys / 10);
+	benchReplicas(1000, 100, 3, keys, numKeys / 10);
+	printf("\n");
+
+	printf("Load balance vs memory, 100 nodes, %zu keys\n", numKeys);
+	benchMultiProbe(100, keys, numKeys);
+	printf("\n");
+
+	printf("circleClosestPoint vs rendezvousLookup, %zu keys\n", numKeys);
+	benchRendezvous(8, 200, keys, numKeys);
+	benchRendezvous(16, 200, keys, numKeys);
+	benchRendezvous(32, 200, keys, numKeys);
+	benchRendezvous(64, 200, keys, numKeys);
+	printf("\n");
+
+	printf("Short key hashing\n");
+	benchHashFunc("fnv1a", benchHash, keys, numKeys);
+	benchHashFunc("wyHash", wyHash, keys, numKeys);
+	printf("\n");
+
+	printf("circleClosestPoint vs circleClosestPointBatch, %zu keys\n", numKeys);
+	benchLookup(10, 100, keys, numKeys);
+	benchLookup(100, 100, keys, numKeys);
+	benchLookup(500, 200, keys, numKeys);
+	benchLookup(1000, 1000, keys, numKeys);
+	benchLookup(5000, 1000, keys, numKeys);
+
+	return 0;
+}
@@ -1,7 +1,18 @@
 #include "HashCircle.h"
+#include "Maglev.h"
+#include "SharedCircle.h"
+#include "FastHash.h"
+#include "MappedCircle.h"
+#include "Rendezvous.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #define PRIME1 3851
 
@@ -22,6 +33,973 @@ myHash(void *key, uint64_t len)
 	return polyHash(key, len, PRIME1, UINT64_MAX);
 }
 
+static void
+circleValidate(Circle *c)
+{
+	uint64_t i;
+	for (i = 1; i < c->numPoints; i++) {
+		if (c->points[i-1].hash >= c->points[i].hash) {
+			abort();
+		}
+	}
+	for (i = 0; i < c->numPoints; i++) {
+		if (c->hashes[i] != c->points[i].hash) {
+			abort();
+		}
+	}
+}
+
+/*
+ * "Hash" a key by reading it as a decimal number.
+ */
+static uint64_t
+decimalHash(void *key, uint64_t len)
+{
+	return strtoull(key, NULL, 10);
+}
+
+/*
+ * Find the closest point the slow way.
+ */
+static Point *
+closestPointLinear(Circle *c, char *name)
+{
+	uint64_t hash = c->hashFunc(name, strlen(name));
+	uint64_t i;
+	for (i = 0; i < c->numPoints; i++) {
+		if (c->points[i].hash >= hash) {
+			return c->points + i;
+		}
+	}
+	return c->points;
+}
+
+static void
+checkLookups(Circle *c)
+{
+	char key[32];
+	int j;
+
+	for (j = 0; j < 200; j++) {
+		snprintf(key, sizeof(key), "lookup-%d", j * 7919);
+		assert(circleClosestPoint(c, key) == closestPointLinear(c, key));
+	}
+
+	/*
+	 * The batch API must agree with the scalar one, including the
+	 * partial batch at the end.
+	 */
+	char batchNames[75][32];
+	char *batchKeys[75];
+	Point *batch[75];
+	for (j = 0; j < 75; j++) {
+		snprintf(batchNames[j], sizeof(batchNames[j]), "batch-%d", j * 104729);
+		batchKeys[j] = batchNames[j];
+	}
+	circleClosestPointBatch(c, batchKeys, 75, batch);
+	for (j = 0; j < 75; j++) {
+		assert(batch[j] == circleClosestPoint(c, batchKeys[j]));
+	}
+
+	/*
+	 * Keys that hash exactly onto a point, or just past one, and the
+	 * ends of the hash space.
+	 */
+	hashFunction hashFunc = c->hashFunc;
+	c->hashFunc = decimalHash;
+	for (j = 0; j < c->numPoints; j++) {
+		Point *p = c->points + j;
+		snprintf(key, sizeof(key), "%" PRIu64, p->hash);
+		assert(circleClosestPoint(c, key) == p);
+		snprintf(key, sizeof(key), "%" PRIu64, p->hash + 1);
+		assert(circleClosestPoint(c, key) == closestPointLinear(c, key));
+	}
+	snprintf(key, sizeof(key), "%" PRIu64, (uint64_t)0);
+	assert(circleClosestPoint(c, key) == c->points);
+	snprintf(key, sizeof(key), "%" PRIu64, UINT64_MAX);
+	assert(circleClosestPoint(c, key) == closestPointLinear(c, key));
+	c->hashFunc = hashFunc;
+}
+
+static void
+testLookup(void)
+{
+	char names[50][16];
+	char *keys[50];
+	int weights[50];
+	int i, b;
+	for (i = 0; i < 50; i++) {
+		snprintf(names[i], sizeof(names[i]), "node%d", i);
+		keys[i] = names[i];
+		weights[i] = 1 + i % 7;
+	}
+
+	/*
+	 * Check every ring size from 1 to 50 nodes, with and without prefix
+	 * tables of a few sizes.
+	 */
+	int bits[] = {0, 1, 4, 8, 16};
+	Circle *c = circleAlloc(myHash);
+	for (i = 0; i < 50; i++) {
+		circleInsert(c, keys[i], NULL, weights[i]);
+		circleValidate(c);
+
+		for (b = 0; b < sizeof(bits) / sizeof(*bits); b++) {
+			assert(circleSetPrefixBits(c, bits[b]) == 0);
+			checkLookups(c);
+		}
+	}
+
+	/*
+	 * The table follows removals and clones.
+	 */
+	assert(circleSetPrefixBits(c, CIRCLE_MAX_PREFIX_BITS + 1) < 0);
+	assert(circleSetPrefixBits(c, 6) == 0);
+	circleRemove(c, circleFindNode(c, keys[17]));
+	checkLookups(c);
+	Circle *clone = circleClone(c);
+	assert(clone->prefixBits == 6);
+	checkLookups(clone);
+	circleFree(&clone);
+	circleFree(&c);
+}
+
+static void
+circleSame(Circle *a, Circle *b)
+{
+	uint64_t i;
+
+	assert(a->numPoints == b->numPoints);
+	for (i = 0; i < a->numPoints; i++) {
+		assert(a->points[i].hash == b->points[i].hash);
+		assert(a->points[i].x == b->points[i].x);
+		assert(a->points[i].node->name == b->points[i].node->name);
+	}
+}
+
+static void
+circleSameAsBuilt(Circle *c, char **keys, int *weights, int numKeys)
+{
+	Circle *built = circleBuild(myHash, keys, NULL, weights, numKeys);
+	assert(built != NULL);
+	circleSame(c, built);
+	circleFree(&built);
+}
+
+static void
+testBuild(char **keys, int numKeys)
+{
+	int weights[numKeys];
+	int i;
+	for (i = 0; i < numKeys; i++) {
+		weights[i] = 2 + i;
+	}
+
+	Circle *a = circleAlloc(myHash);
+	for (i = 0; i < numKeys; i++) {
+		circleInsert(a, keys[i], NULL, weights[i]);
+	}
+
+	Circle *b = circleBuild(myHash, keys, NULL, weights, numKeys);
+	assert(b != NULL);
+	circleValidate(b);
+
+	circleSame(a, b);
+
+	/*
+	 * Inserting a node that is already on the circle must fail and
+	 * leave the circle untouched.
+	 */
+	assert(circleInsertBatch(b, keys, NULL, weights, 1, NULL) < 0);
+	assert(a->numPoints == b->numPoints);
+
+	/*
+	 * A negative weight must be rejected, not taken as a huge point count.
+	 */
+	weights[1] = -1;
+	assert(circleBuild(myHash, keys, NULL, weights, numKeys) == NULL);
+
+	circleFree(&a);
+	circleFree(&b);
+}
+
+static void
+testMembership(char **keys, int numKeys)
+{
+	int weights[numKeys];
+	Node *nodes[numKeys];
+	int i;
+	for (i = 0; i < numKeys; i++) {
+		weights[i] = 4;
+	}
+
+	Circle *c = circleAlloc(myHash);
+	assert(circleInsertBatch(c, keys, NULL, weights, numKeys, nodes) == 0);
+
+	/*
+	 * Reweighting must give the same points as building with that weight.
+	 */
+	assert(circleReweight(c, nodes[1], 7) == 0);
+	assert(nodes[1]->weight == 7);
+	weights[1] = 7;
+	circleSameAsBuilt(c, keys, weights, numKeys);
+
+	assert(circleReweight(c, nodes[1], 1) == 0);
+	weights[1] = 1;
+	circleSameAsBuilt(c, keys, weights, numKeys);
+
+	/*
+	 * Removing the first node must give the same points as never adding it.
+	 */
+	assert(circleRemove(c, nodes[0]) == 0);
+	circleValidate(c);
+	circleSameAsBuilt(c, keys + 1, weights + 1, numKeys - 1);
+
+	int n = 0;
+	Node *node;
+	for (node = c->nodes; node; node = node->next) {
+		n++;
+	}
+	assert(n == numKeys - 1);
+
+	circleFree(&c);
+}
+
+static void
+testMaglev(void)
+{
+	char names[11][16];
+	char *keys[11];
+	int weights[11];
+	int i;
+	for (i = 0; i < 11; i++) {
+		snprintf(names[i], sizeof(names[i]), "node%d", i);
+		keys[i] = names[i];
+		weights[i] = (i == 0) ? 200 : 100;
+	}
+
+	Circle *c = circleBuild(myHash, keys, NULL, weights, 10);
+	Maglev *m = maglevAlloc(myHash, 65536);
+	assert(m != NULL && m->size == 65537);
+	assert(maglevBuild(m, c->nodes) == m->size);
+
+	/*
+	 * Node 0 has twice the weight, so it should own about twice the slots.
+	 */
+	uint64_t owned[10] = {0};
+	uint64_t j;
+	for (j = 0; j < m->size; j++) {
+		for (i = 0; i < 10; i++) {
+			if (m->table[j]->name != keys[i]) {
+				continue;
+			}
+			owned[i]++;
+		}
+	}
+	for (i = 1; i < 10; i++) {
+		assert(owned[0] > owned[i] * 3 / 2 && owned[0] < owned[i] * 5 / 2);
+	}
+
+	/*
+	 * Record where a sample of keys lands, add a node and see how many move.
+	 */
+	int numSamples = 10000;
+	Node **ringBefore = malloc(numSamples * sizeof(*ringBefore));
+	Node **maglevBefore = malloc(numSamples * sizeof(*maglevBefore));
+	char key[32];
+	for (i = 0; i < numSamples; i++) {
+		snprintf(key, sizeof(key), "sample-%d", i);
+		ringBefore[i] = circleClosestPoint(c, key)->node;
+		maglevBefore[i] = maglevLookup(m, key);
+	}
+
+	circleInsert(c, keys[10], NULL, weights[10]);
+	int64_t moved = maglevBuild(m, c->nodes);
+	assert(moved > 0 && moved < m->size / 4);
+
+	int ringMoved = 0, maglevMoved = 0;
+	for (i = 0; i < numSamples; i++) {
+		snprintf(key, sizeof(key), "sample-%d", i);
+		ringMoved += circleClosestPoint(c, key)->node != ringBefore[i];
+		maglevMoved += maglevLookup(m, key) != maglevBefore[i];
+	}
+	printf("Adding 1 node to 10: ring moved %.2f%% of keys, maglev moved %.2f%% (%.2f%% of slots)\n",
+			100.0 * ringMoved / numSamples, 100.0 * maglevMoved / numSamples,
+			100.0 * moved / m->size);
+
+	/*
+	 * Removing a node frees it before the rebuild counts what moved.
+	 */
+	circleRemove(c, circleFindNode(c, keys[10]));
+	moved = maglevBuild(m, c->nodes);
+	assert(moved > 0 && moved < m->size / 4);
+
+	free(ringBefore);
+	free(maglevBefore);
+	maglevFree(&m);
+	assert(m == NULL);
+
+	m = maglevAlloc(NULL, 1000);
+	assert(m != NULL && maglevBuild(m, c->nodes) == m->size);
+	assert(maglevLookup(m, "key") != NULL);
+	maglevFree(&m);
+	circleFree(&c);
+}
+
+static atomic_int sharedStop;
+
+static void *
+sharedReader(void *arg)
+{
+	SharedCircle *s = arg;
+	CircleReader *r = sharedCircleRegister(s);
+	char key[32];
+	uint64_t i = 0;
+
+	assert(r != NULL);
+	while (!atomic_load(&sharedStop)) {
+		Circle *c = sharedCircleReadBegin(r);
+		snprintf(key, sizeof(key), "reader-%" PRIu64, i++);
+		Point *p = circleClosestPoint(c, key);
+		assert(p->node->weight > 0 && strncmp(p->node->name, "node", 4) == 0);
+		sharedCircleReadEnd(r);
+
+		if (i % 64 == 0) {
+			CircleSnapshot *snap = sharedCircleAcquire(r);
+			assert(circleClosestPoint(snap->circle, key)->node->weight > 0);
+			sharedCircleRelease(snap);
+		}
+	}
+
+	sharedCircleUnregister(&r);
+	return NULL;
+}
+
+static void
+testShared(void)
+{
+	char names[11][16];
+	char *keys[11];
+	int weights[11];
+	int i;
+	for (i = 0; i < 11; i++) {
+		snprintf(names[i], sizeof(names[i]), "node%d", i);
+		keys[i] = names[i];
+		weights[i] = 10;
+	}
+
+	Circle *c = circleBuild(myHash, keys, NULL, weights, 10);
+	Circle *clone = circleClone(c);
+	circleSame(c, clone);
+	assert(clone->nodes != c->nodes && clone->points[0].node != c->points[0].node);
+	circleFree(&clone);
+	assert(clone == NULL);
+
+	SharedCircle *s = sharedCircleAlloc(c);
+	assert(s != NULL);
+
+	pthread_t threads[4];
+	for (i = 0; i < 4; i++) {
+		pthread_create(threads + i, NULL, sharedReader, s);
+	}
+
+	/*
+	 * Keep adding, reweighting and removing a node while the readers run.
+	 */
+	for (i = 0; i < 300; i++) {
+		Circle *next = sharedCircleUpdateBegin(s);
+		assert(next != NULL);
+
+		Node *n = circleFindNode(next, keys[10]);
+		if (n == NULL) {
+			assert(circleInsert(next, keys[10], NULL, weights[10]) != NULL);
+		} else if (n->weight == weights[10]) {
+			assert(circleReweight(next, n, 2 * weights[10]) == 0);
+		} else {
+			assert(circleRemove(next, n) == 0);
+		}
+		assert(sharedCircleUpdateCommit(s, next) == 0);
+	}
+
+	atomic_store(&sharedStop, 1);
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/*
+	 * Acquiring inside a read section must leave the section open.
+	 */
+	CircleReader *r = sharedCircleRegister(s);
+	assert(r != NULL);
+	c = sharedCircleReadBegin(r);
+	uint64_t epoch = atomic_load(&r->epoch);
+	CircleSnapshot *snap = sharedCircleAcquire(r);
+	assert(snap->circle == c && atomic_load(&r->epoch) == epoch);
+	sharedCircleRelease(snap);
+	sharedCircleReadEnd(r);
+	assert(atomic_load(&r->epoch) == 0);
+	sharedCircleUnregister(&r);
+
+	sharedCircleSynchronize(s);
+	assert(s->retired == NULL);
+	assert(circleFindNode(atomic_load(&s->current)->circle, keys[10]) == NULL);
+	sharedCircleFree(&s);
+}
+
+/*
+ * Find the replicas the slow way, one point at a time.
+ */
+static int
+replicasLinear(Circle *c, char *key, int n, Node **out)
+{
+	int count = 0;
+	Point *start = circleClosestPoint(c, key);
+	Point *p = start;
+
+	do {
+		int j;
+		for (j = 0; j < count && out[j] != p->node; j++);
+		if (j == count) {
+			out[count++] = p->node;
+		}
+	} while (count < n && (p = circleNextPoint(c, p)) != start);
+
+	return count;
+}
+
+static void
+testReplicas(void)
+{
+	char names[20][16];
+	char *keys[20];
+	int weights[20];
+	int i;
+	for (i = 0; i < 20; i++) {
+		snprintf(names[i], sizeof(names[i]), "node%d", i);
+		keys[i] = names[i];
+		weights[i] = 1 + (i * 37) % 50;
+	}
+
+	Node *out[25], *expect[25];
+	char key[32];
+	int depth, j, n;
+
+	/*
+	 * Without the index, and with one that covers only some of the
+	 * preference lists asked for.
+	 */
+	for (depth = 0; depth <= 9; depth += 9) {
+		Circle *c = circleAlloc(myHash);
+		assert(circleSetReplicaDepth(c, depth) == 0);
+		assert(circleReplicas(c, "empty", 3, out) == 0);
+
+		for (i = 0; i < 20; i++) {
+			circleInsert(c, keys[i], NULL, weights[i]);
+			if (i == 10) {
+				circleRemove(c, circleFindNode(c, keys[3]));
+				circleInsert(c, keys[3], NULL, weights[3]);
+			}
+
+			Circle *clone = circleClone(c);
+			assert(clone->replicaDepth == depth);
+			for (j = 0; j < 100; j++) {
+				snprintf(key, sizeof(key), "replica-%d", j * 31);
+				for (n = 1; n <= 25; n += 4) {
+					int got = circleReplicas(c, key, n, out);
+					assert(got == (n < i + 1 ? n : i + 1));
+					assert(got == replicasLinear(c, key, n, expect));
+					assert(memcmp(out, expect, got * sizeof(*out)) == 0);
+					assert(circleReplicas(clone, key, n, out) == got);
+					while (got-- > 0) {
+						assert(out[got]->name == expect[got]->name);
+					}
+				}
+			}
+			circleFree(&clone);
+		}
+
+		circleFree(&c);
+	}
+	assert(circleSetReplicaDepth(NULL, -1) < 0);
+}
+
+static void
+testBoundedLoad(void)
+{
+	char names[10][16];
+	char *keys[10];
+	int weights[10];
+	Node *nodes[10];
+	int i;
+	for (i = 0; i < 10; i++) {
+		snprintf(names[i], sizeof(names[i]), "node%d", i);
+		keys[i] = names[i];
+		weights[i] = (i < 5) ? 10 : 20;
+	}
+
+	Circle *c = circleAlloc(myHash);
+	circleInsertBatch(c, keys, NULL, weights, 10, nodes);
+	assert(c->totalWeight == 150);
+	assert(circleSetLoadBound(c, 0.5) < 0);
+	assert(circleSetLoadBound(c, 1.25) == 0);
+
+	int numKeys = 10000;
+	Point **assigned = malloc(numKeys * sizeof(*assigned));
+	char key[32];
+	for (i = 0; i < numKeys; i++) {
+		snprintf(key, sizeof(key), "load-%d", i);
+		assigned[i] = circleAssign(c, key);
+		assert(assigned[i] != NULL);
+	}
+	assert(c->totalLoad == numKeys);
+
+	/*
+	 * No node may be over 1.25x its weighted share.
+	 */
+	uint64_t total = 0;
+	for (i = 0; i < 10; i++) {
+		assert(nodes[i]->load <= ceil(1.25 * numKeys * nodes[i]->weight / c->totalWeight));
+		total += nodes[i]->load;
+	}
+	assert(total == numKeys);
+
+	for (i = 0; i < numKeys; i++) {
+		circleRelease(c, assigned[i]->node);
+	}
+	assert(c->totalLoad == 0);
+	for (i = 0; i < 10; i++) {
+		assert(nodes[i]->load == 0);
+	}
+
+	free(assigned);
+	circleFree(&c);
+}
+
+static void
+testFastHash(void)
+{
+	/*
+	 * The reference wyhash test vectors, seeded with their index.
+	 */
+	char *messages[] = {
+		"",
+		"a",
+		"abc",
+		"message digest",
+		"abcdefghijklmnopqrstuvwxyz",
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+		"12345678901234567890123456789012345678901234567890123456789012345678901234567890"
+	};
+	uint64_t expect[] = {
+		0x93228a4de0eec5a2ULL,
+		0xc5bac3db178713c4ULL,
+		0xa97f2f7b1d9b3314ULL,
+		0x786d1f1df3801df4ULL,
+		0xdca5a8138ad37c87ULL,
+		0xb9e734f117cfaf70ULL,
+		0x6cc5eab49a92d617ULL
+	};
+	int i;
+	for (i = 0; i < sizeof(expect) / sizeof(*expect); i++) {
+		assert(wyHashSeed(messages[i], strlen(messages[i]), i) == expect[i]);
+	}
+
+	/*
+	 * A NULL hash function picks the built-in one.
+	 */
+	Circle *c = circleAlloc(NULL);
+	assert(c->hashFunc == wyHash);
+	assert(circleInsert(c, "node", NULL, 1000) != NULL);
+	circleValidate(c);
+	circleFree(&c);
+}
+
+static Node *
+ownerOf(Circle *c, uint64_t hash)
+{
+	uint64_t i;
+	for (i = 0; i < c->numPoints; i++) {
+		if (c->points[i].hash >= hash) {
+			return c->points[i].node;
+		}
+	}
+	return c->numPoints ? c->points[0].node : NULL;
+}
+
+static char *
+nodeName(Node *n)
+{
+	return n ? n->name : "(none)";
+}
+
+/*
+ * Check 'ranges' against the owner of 'hash' in both Circles.
+ */
+static void
+checkRanges(Circle *a, Circle *b, CircleRange *ranges, int64_t num, uint64_t hash)
+{
+	int64_t i;
+	for (i = 0; i < num && ranges[i].last < hash; i++);
+
+	char *from = nodeName(ownerOf(a, hash));
+	char *to = nodeName(ownerOf(b, hash));
+	if (i < num && ranges[i].first <= hash) {
+		assert(strcmp(from, nodeName(ranges[i].from)) == 0);
+		assert(strcmp(to, nodeName(ranges[i].to)) == 0);
+		assert(strcmp(from, to) != 0);
+	} else {
+		assert(strcmp(from, to) == 0);
+	}
+}
+
+static void
+checkDiff(Circle *a, Circle *b, CircleRange *ranges, int64_t num)
+{
+	int64_t i;
+	uint64_t j;
+
+	assert(num >= 0);
+	for (i = 0; i < num; i++) {
+		assert(ranges[i].first <= ranges[i].last);
+		assert(i == 0 || ranges[i-1].last < ranges[i].first);
+	}
+
+	Circle *both[] = {a, b};
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < both[i]->numPoints; j++) {
+			uint64_t h = both[i]->points[j].hash;
+			checkRanges(a, b, ranges, num, h);
+			checkRanges(a, b, ranges, num, h - 1);
+			checkRanges(a, b, ranges, num, h + 1);
+		}
+	}
+	for (j = 0; j < 1000; j++) {
+		checkRanges(a, b, ranges, num, mixHash(j));
+	}
+	checkRanges(a, b, ranges, num, 0);
+	checkRanges(a, b, ranges, num, UINT64_MAX);
+}
+
+static void
+testDiff(void)
+{
+	char names[11][16];
+	char *keys[11];
+	int weights[11];
+	int i;
+	for (i = 0; i < 11; i++) {
+		snprintf(names[i], sizeof(names[i]), "node%d", i);
+		keys[i] = names[i];
+		weights[i] = 5 + i;
+	}
+
+	Circle *empty = circleAlloc(NULL);
+	Circle *a = circleBuild(NULL, keys, NULL, weights, 10);
+	CircleRange *ranges;
+	int64_t num;
+
+	/*
+	 * Adding a node only moves ranges onto that node.
+	 */
+	Circle *b = circleClone(a);
+	circleInsert(b, keys[10], NULL, weights[10]);
+	num = circleDiff(a, b, &ranges);
+	checkDiff(a, b, ranges, num);
+	assert(num > 0);
+	for (i = 0; i < num; i++) {
+		assert(ranges[i].to->name == keys[10]);
+	}
+
+	CircleRange *pending;
+	Node n = { .name = keys[10], .weight = weights[10] };
+	assert(circleDiffInsert(a, &n, &pending) == num);
+	for (i = 0; i < num; i++) {
+		assert(pending[i].first == ranges[i].first && pending[i].last == ranges[i].last);
+		assert(pending[i].to == &n);
+	}
+	free(pending);
+	free(ranges);
+
+	/*
+	 * Removing it moves them back.
+	 */
+	Node *added = circleFindNode(b, keys[10]);
+	num = circleDiffRemove(b, added, &ranges);
+	checkDiff(b, a, ranges, num);
+	for (i = 0; i < num; i++) {
+		assert(ranges[i].from == added);
+	}
+	free(ranges);
+
+	/*
+	 * Reweighting moves ranges between many nodes.
+	 */
+	circleReweight(b, circleFindNode(b, keys[3]), 30);
+	circleRemove(b, circleFindNode(b, keys[7]));
+	num = circleDiff(a, b, &ranges);
+	checkDiff(a, b, ranges, num);
+	free(ranges);
+
+	num = circleDiff(a, a, &ranges);
+	assert(num == 0);
+	free(ranges);
+
+	num = circleDiff(empty, a, &ranges);
+	checkDiff(empty, a, ranges, num);
+	assert(ranges[0].first == 0 && ranges[num-1].last == UINT64_MAX);
+	free(ranges);
+
+	circleFree(&a);
+	circleFree(&b);
+	circleFree(&empty);
+}
+
+static void
+testMapped(void)
+{
+	char names[20][16];
+	char *keys[20];
+	int weights[20];
+	int i;
+	for (i = 0; i < 20; i++) {
+		snprintf(names[i], sizeof(names[i]), "node%d", i);
+		keys[i] = names[i];
+		weights[i] = 10 + i;
+	}
+
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/hashcircle-test-%d.snap", (int)getpid());
+
+	Circle *c = circleBuild(NULL, keys, NULL, weights, 20);
+	assert(circleSave(c, path) == 0);
+
+	MappedCircle *m = circleOpenMapped(path, NULL, 1);
+	assert(m != NULL);
+	assert(m->numPoints == c->numPoints && m->numNodes == 20);
+
+	char key[32];
+	for (i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "mapped-%d", i);
+		Node *expect = circleClosestPoint(c, key)->node;
+		const MappedNode *n = mappedClosestNode(m, key);
+		assert(strcmp(mappedNodeName(m, n), expect->name) == 0);
+		assert(n->weight == expect->weight);
+	}
+	circleCloseMapped(&m);
+	assert(m == NULL);
+
+	/*
+	 * Flip one bit of a point hash and the checksum must catch it.
+	 */
+	FILE *f = fopen(path, "r+");
+	assert(f != NULL);
+	fseek(f, sizeof(MappedHeader) + 8, SEEK_SET);
+	int byte = fgetc(f);
+	fseek(f, sizeof(MappedHeader) + 8, SEEK_SET);
+	fputc(byte ^ 1, f);
+	fclose(f);
+	assert(circleOpenMapped(path, NULL, 1) == NULL);
+	m = circleOpenMapped(path, NULL, 0);
+	assert(m != NULL);
+	circleCloseMapped(&m);
+
+	/*
+	 * Unverified, lookups stay inside the mapping whatever node the points
+	 * say they belong to.
+	 */
+	MappedHeader h;
+	f = fopen(path, "r+");
+	assert(f != NULL && fread(&h, sizeof(h), 1, f) == 1);
+	fseek(f, h.nodeIndexOffset, SEEK_SET);
+	for (i = 0; i < h.numPoints * sizeof(uint32_t); i++) {
+		fputc(0xff, f);
+	}
+	fflush(f);
+	assert(circleOpenMapped(path, NULL, 1) == NULL);
+	m = circleOpenMapped(path, NULL, 0);
+	assert(m != NULL);
+	for (i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "mapped-%d", i);
+		const MappedNode *n = mappedClosestNode(m, key);
+		assert(n >= m->nodes && n < m->nodes + m->numNodes);
+		assert(strlen(mappedNodeName(m, n)) < m->namesSize);
+	}
+	circleCloseMapped(&m);
+
+	/*
+	 * The header is always checked, so its offsets are never trusted.
+	 */
+	h.hashesOffset = h.fileSize + 8;
+	rewind(f);
+	assert(fwrite(&h, sizeof(h), 1, f) == 1);
+	fclose(f);
+	assert(circleOpenMapped(path, NULL, 0) == NULL);
+
+	unlink(path);
+	assert(circleOpenMapped(path, NULL, 1) == NULL);
+
+	/*
+	 * An empty Circle round trips too.
+	 */
+	Circle *empty = circleAlloc(NULL);
+	assert(circleSave(empty, path) == 0);
+	m = circleOpenMapped(path, NULL, 1);
+	assert(m != NULL && mappedClosestNode(m, "key") == NULL);
+	circleCloseMapped(&m);
+	unlink(path);
+
+	circleFree(&empty);
+	circleFree(&c);
+}
+
+static void
+testRendezvous(void)
+{
+	char names[13][16];
+	char *keys[13];
+	int weights[13];
+	Node *nodes[13];
+	int i, j;
+	for (i = 0; i < 13; i++) {
+		snprintf(names[i], sizeof(names[i]), "node%d", i);
+		keys[i] = names[i];
+		weights[i] = 1;
+	}
+
+	Circle *c = circleAlloc(NULL);
+	circleInsertBatch(c, keys, NULL, weights, 13, nodes);
+
+	Rendezvous *r = rendezvousAlloc(NULL);
+	assert(rendezvousLookup(r, "key") == NULL);
+	assert(rendezvousBuild(r, c->nodes) == 0);
+	assert(!r->weighted && r->numNodes == 13);
+
+	int numKeys = 13000;
+	Node **before = malloc(numKeys * sizeof(*before));
+	char key[32];
+	Node *top[20];
+	for (i = 0; i < numKeys; i++) {
+		snprintf(key, sizeof(key), "hrw-%d", i);
+		before[i] = rendezvousLookup(r, key);
+
+		/*
+		 * Top-k must be distinct and start with the lookup result.
+		 */
+		assert(rendezvousTopK(r, key, 20, top) == 13);
+		assert(top[0] == before[i]);
+		for (j = 1; j < 13; j++) {
+			int l;
+			for (l = 0; l < j; l++) {
+				assert(top[l] != top[j]);
+			}
+		}
+	}
+	assert(rendezvousTopK(r, key, INT_MAX, top) == 13);
+
+	/*
+	 * Taking a node away only moves that node's keys.
+	 */
+	circleRemove(c, nodes[5]);
+	assert(rendezvousBuild(r, c->nodes) == 0);
+	for (i = 0; i < numKeys; i++) {
+		snprintf(key, sizeof(key), "hrw-%d", i);
+		Node *after = rendezvousLookup(r, key);
+		assert(after != nodes[5]);
+		assert(before[i] == nodes[5] || after == before[i]);
+	}
+
+	/*
+	 * Node 0 has three times the weight, so it should get about three
+	 * times the keys of any other node.
+	 */
+	circleReweight(c, nodes[0], 3);
+	assert(rendezvousBuild(r, c->nodes) == 0);
+	assert(r->weighted);
+	uint64_t count[13] = {0};
+	for (i = 0; i < numKeys; i++) {
+		snprintf(key, sizeof(key), "hrw-%d", i);
+		Node *n = rendezvousLookup(r, key);
+		for (j = 0; nodes[j] != n; j++);
+		count[j]++;
+	}
+	for (j = 1; j < 13; j++) {
+		if (j == 5) {
+			assert(count[j] == 0);
+			continue;
+		}
+		assert(count[0] > count[j] * 2 && count[0] < count[j] * 4);
+	}
+
+	free(before);
+	rendezvousFree(&r);
+	circleFree(&c);
+}
+
+/*
+ * Largest node load divided by the mean, after looking up 'numKeys' keys
+ * with 'k' probes.
+ */
+static double
+peakToMean(Circle *c, int numNodes, int numKeys, int k)
+{
+	uint64_t *load = calloc(numNodes, sizeof(*load));
+	char key[32];
+	int i;
+
+	for (i = 0; i < numKeys; i++) {
+		snprintf(key, sizeof(key), "probe-%d", i);
+		Point *p = circleMultiProbePoint(c, key, k);
+		load[strtol(p->node->name + 4, NULL, 10)]++;
+	}
+
+	uint64_t peak = 0;
+	for (i = 0; i < numNodes; i++) {
+		if (load[i] > peak) {
+			peak = load[i];
+		}
+	}
+	free(load);
+
+	return (double)peak * numNodes / numKeys;
+}
+
+static void
+testMultiProbe(void)
+{
+	char names[50][16];
+	char *keys[50];
+	int weights[50];
+	int i;
+	for (i = 0; i < 50; i++) {
+		snprintf(names[i], sizeof(names[i]), "node%d", i);
+		keys[i] = names[i];
+		weights[i] = 1;
+	}
+
+	Circle *c = circleBuild(NULL, keys, NULL, weights, 50);
+	assert(circleMultiProbePoint(c, "key", 0) == NULL);
+
+	/*
+	 * One probe is a plain lookup.
+	 */
+	char key[32];
+	for (i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "probe-%d", i);
+		assert(circleMultiProbePoint(c, key, 1) == circleClosestPoint(c, key));
+	}
+
+	/*
+	 * More probes even out the load of single-point nodes.
+	 */
+	double one = peakToMean(c, 50, 50000, 1);
+	double many = peakToMean(c, 50, 50000, 21);
+	printf("Multi-probe peak-to-mean load with 50 single-point nodes: k=1 %.2f, k=21 %.2f\n",
+			one, many);
+	assert(many < one && many < 1.5);
+
+	circleFree(&c);
+}
+
 int main()
 {
 	Circle *c = circleAlloc(myHash);
@@ -56,5 +1034,20 @@ int main()
 		}
 	}
 
+	testBuild(keys, numKeys);
+	testMembership(keys, numKeys);
+	testMaglev();
+	testLookup();
+	testShared();
+	testReplicas();
+	testBoundedLoad();
+	testFastHash();
+	testDiff();
+	testMapped();
+	testRendezvous();
+	testMultiProbe();
+
+	circleFree(&c);
+
 	return 0;
 }
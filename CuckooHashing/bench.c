@@ -0,0 +1,525 @@
+#include "cuckoo.h"
+#include "bucket.h"
+#include "hash.h"
+#include "shared.h"
+#include "filter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <math.h>
+#include <unistd.h>
+
+#define KEY_LEN 40
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * 'n' distinct keys of KEY_LEN bytes, laid out back to back.
+ */
+static uint8_t *
+benchKeys(uint64_t n)
+{
+	uint8_t *keys = calloc(n, KEY_LEN);
+	uint64_t i;
+	for (i = 0; i < n; i++) {
+		snprintf((char *)keys + i * KEY_LEN, KEY_LEN, "user:%016" PRIx64 ":session:%08" PRIx64,
+		         (uint64_t)(i * 0x9e3779b97f4a7c15ULL), i);
+	}
+	return keys;
+}
+
+static void
+benchHash(const char *name, CuckooHashFunction hashFunc, uint8_t *keys, uint64_t n)
+{
+	uint64_t hash[2], sum = 0;
+	uint64_t i;
+
+	double start = now();
+	for (i = 0; i < n; i++) {
+		hashFunc(keys + i * KEY_LEN, KEY_LEN, 0, hash);
+		sum += hash[0] ^ hash[1];
+	}
+	double elapsed = now() - start;
+
+	printf("%-6s %6.1f ns/key (%" PRIx64 ")\n", name, elapsed * 1e9 / n, sum);
+}
+
+static void
+benchTable(const char *name, CuckooHashFunction hashFunc, uint8_t *keys, uint64_t n)
+{
+	CuckooTable *t = cuckooAlloc(4, NULL);
+	uint64_t found = 0;
+	uint64_t i;
+
+	cuckooSetHash(t, hashFunc, 0x5eed);
+
+	double start = now();
+	for (i = 0; i < n; i++) {
+		cuckooInsert(t, keys + i * KEY_LEN, KEY_LEN, NULL);
+	}
+	double insert = now() - start;
+
+	start = now();
+	for (i = 0; i < n; i++) {
+		found += cuckooLookup(t, keys + i * KEY_LEN, KEY_LEN) != NULL;
+	}
+	double lookup = now() - start;
+
+	printf("%-6s insert %6.1f ns/key, lookup %6.1f ns/key, %" PRIu64 "/%" PRIu64 " found, load %.2f\n",
+	       name, insert * 1e9 / n, lookup * 1e9 / n, found, n, (double)t->count / t->size);
+
+	cuckooFree(&t);
+}
+
+/*
+ * Lookups in a table that points at the caller's keys against one that
+ * keeps them inline, for keys short enough to fit and keys that go to the
+ * arena.
+ */
+static void
+benchInline(uint64_t n)
+{
+	int lens[] = {16, KEY_LEN};
+	int l, mode;
+
+	for (l = 0; l < 2; l++) {
+		uint8_t *keys = calloc(n, lens[l]);
+		uint64_t i;
+
+		for (i = 0; i < n; i++) {
+			uint64_t k = i * 0x9e3779b97f4a7c15ULL;
+			memcpy(keys + i * lens[l], &k, sizeof(k));
+			memcpy(keys + i * lens[l] + lens[l] - sizeof(i), &i, sizeof(i));
+		}
+
+		for (mode = 0; mode < 2; mode++) {
+			CuckooTable *t = cuckooAlloc(4, NULL);
+			uint64_t found = 0;
+
+			if (mode) {
+				cuckooSetInlineKeys(t);
+			}
+
+			double start = now();
+			for (i = 0; i < n; i++) {
+				cuckooInsert(t, keys + i * lens[l], lens[l], NULL);
+			}
+			double insert = now() - start;
+
+			/*
+			 * Look up a copy of the key, the way a request would, so the
+			 * stored key isn't already in cache.
+			 */
+			uint8_t copy[KEY_LEN];
+			start = now();
+			for (i = 0; i < n; i++) {
+				uint64_t j = (i * 7919) % n;
+				memcpy(copy, keys + j * lens[l], lens[l]);
+				found += cuckooLookup(t, copy, lens[l]) != NULL;
+			}
+			double lookup = now() - start;
+
+			printf("%2d byte keys, %-7s insert %6.1f ns/key, lookup %6.1f ns/key (%" PRIu64 " found)\n",
+			       lens[l], mode ? "inline" : "pointer", insert * 1e9 / n, lookup * 1e9 / n, found);
+
+			cuckooFree(&t);
+		}
+		free(keys);
+	}
+}
+
+static int
+latencyCompare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Time every insert on its own. The tail is where evictions and resizes
+ * show up.
+ */
+static void
+benchInsertLatency(uint8_t *keys, uint64_t n)
+{
+	CuckooTable *t = cuckooAlloc(4, NULL);
+	double *latency = malloc(n * sizeof(*latency));
+	uint64_t resizes = 0;
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		uint64_t size = t->size;
+		double start = now();
+		cuckooInsert(t, keys + i * KEY_LEN, KEY_LEN, NULL);
+		latency[i] = now() - start;
+		resizes += t->size != size;
+	}
+	qsort(latency, n, sizeof(*latency), latencyCompare);
+
+	printf("insert latency p50 %.0f ns, p99 %.0f ns, p99.9 %.0f ns, max %.1f ms; "
+	       "%" PRIu64 " resizes, %" PRIu64 " slots, load %.2f\n",
+	       latency[n / 2] * 1e9, latency[n * 99 / 100] * 1e9, latency[n * 999 / 1000] * 1e9,
+	       latency[n - 1] * 1e3, resizes, t->size, (double)t->count / t->size);
+
+	CuckooStats stats;
+	cuckooStats(t, &stats);
+	printf("kicks per placement:");
+	for (i = 0; i < CUCKOO_KICK_BUCKETS; i++) {
+		printf(" %" PRIu64, stats.kicks[i]);
+	}
+	printf(", stashed %" PRIu64 "\n", stats.stashed);
+	printf("%" PRIu64 " grows, %" PRIu64 " rebuilds, %.1f ms resizing; lookup probes:",
+	       stats.grows, stats.rebuilds, stats.resizeNanos / 1e6);
+	for (i = 0; i <= CUCKOO_MAX_PROBES; i++) {
+		printf(" %" PRIu64, stats.probes[i]);
+	}
+	printf("\n");
+#ifdef CUCKOO_LATENCY
+	printf("insert latency by power of two ns:");
+	for (i = 0; i < CUCKOO_LATENCY_BUCKETS; i++) {
+		printf(" %" PRIu64, stats.insertLatency[i]);
+	}
+	printf("\n");
+#endif
+
+	free(latency);
+	cuckooFree(&t);
+}
+
+static void
+benchBucket(uint8_t *keys, uint64_t n)
+{
+	BucketTable *t = bucketAlloc(4, NULL);
+	uint64_t found = 0;
+	uint64_t i;
+
+	double start = now();
+	for (i = 0; i < n; i++) {
+		bucketInsert(t, keys + i * KEY_LEN, KEY_LEN, NULL);
+	}
+	double insert = now() - start;
+
+	start = now();
+	for (i = 0; i < n; i++) {
+		found += bucketLookup(t, keys + i * KEY_LEN, KEY_LEN) != NULL;
+	}
+	double lookup = now() - start;
+
+	printf("bucket insert %6.1f ns/key, lookup %6.1f ns/key, %" PRIu64 "/%" PRIu64 " found, load %.2f\n",
+	       insert * 1e9 / n, lookup * 1e9 / n, found, n, bucketLoadFactor(t));
+
+	bucketFree(&t);
+}
+
+typedef struct SharedBench {
+	SharedTable *t;
+	uint8_t *keys;
+	uint64_t n;
+	uint64_t start;
+	uint64_t found;
+} SharedBench;
+
+static void *
+sharedBenchThread(void *arg)
+{
+	SharedBench *sb = arg;
+	uint64_t i, j = sb->start, found = 0;
+
+	for (i = 0; i < sb->n; i++) {
+		found += sharedLookup(sb->t, sb->keys + j * KEY_LEN, KEY_LEN, NULL);
+		j = (j + 7919) % sb->n;
+	}
+	sb->found = found;
+	return NULL;
+}
+
+/*
+ * Random lookups one at a time against cuckooLookupBatch in groups of 64,
+ * on inline key tables of 1 MB up to 'maxBytes'. Each table is filled to
+ * 40% so it never grows.
+ */
+static void
+benchBatch(uint64_t maxBytes)
+{
+	uint64_t lookups = 1 << 20;
+	void **ptrs = malloc(lookups * sizeof(*ptrs));
+	uint64_t *lens = malloc(lookups * sizeof(*lens));
+	CuckooElement **out = malloc(64 * sizeof(*out));
+	uint64_t bytes, i, j;
+
+	for (bytes = 1 << 20; bytes <= maxBytes; bytes *= 4) {
+		uint64_t slots = bytes / sizeof(CuckooInlineElement);
+		uint64_t n = slots * 2 / 5;
+		uint64_t *keys = malloc(n * sizeof(*keys));
+		CuckooTable *t = cuckooAlloc(slots, NULL);
+		uint64_t found = 0;
+
+		cuckooSetInlineKeys(t);
+		for (i = 0; i < n; i++) {
+			keys[i] = i * 0x9e3779b97f4a7c15ULL;
+			cuckooInsert(t, keys + i, sizeof(*keys), NULL);
+		}
+		for (i = 0, j = 0; i < lookups; i++) {
+			ptrs[i] = keys + j;
+			lens[i] = sizeof(*keys);
+			j = (j + 1000003) % n;
+		}
+
+		double start = now();
+		for (i = 0; i < lookups; i++) {
+			found += cuckooLookup(t, ptrs[i], lens[i]) != NULL;
+		}
+		double single = now() - start;
+
+		start = now();
+		for (i = 0; i < lookups; i += 64) {
+			found += cuckooLookupBatch(t, ptrs + i, lens + i, 64, out);
+		}
+		double batch = now() - start;
+
+		printf("%7" PRIu64 " MB: single %6.1f ns/key, batch %6.1f ns/key (%.2fx), %" PRIu64 "/%" PRIu64 " found%s\n",
+		       bytes >> 20, single * 1e9 / lookups, batch * 1e9 / lookups, single / batch,
+		       found, 2 * lookups, t->size * t->slotSize == bytes ? "" : ", grew");
+
+		cuckooFree(&t);
+		free(keys);
+	}
+
+	free(out);
+	free(lens);
+	free(ptrs);
+}
+
+/*
+ * Lookup throughput of a SharedTable as reader threads are added. Each
+ * thread does 'n' lookups.
+ */
+static void
+benchShared(uint8_t *keys, uint64_t n)
+{
+	SharedTable *t = sharedAlloc(n, NULL);
+	uint64_t i;
+	int threads;
+
+	for (i = 0; i < n; i++) {
+		sharedInsert(t, keys + i * KEY_LEN, KEY_LEN, NULL);
+	}
+
+	for (threads = 1; threads <= 8; threads *= 2) {
+		pthread_t tid[8];
+		SharedBench sb[8];
+		uint64_t found = 0;
+		int j;
+
+		double start = now();
+		for (j = 0; j < threads; j++) {
+			sb[j] = (SharedBench){t, keys, n, j * n / threads, 0};
+			pthread_create(tid + j, NULL, sharedBenchThread, sb + j);
+		}
+		for (j = 0; j < threads; j++) {
+			pthread_join(tid[j], NULL);
+			found += sb[j].found;
+		}
+		double elapsed = now() - start;
+
+		printf("%d threads: %6.1f M lookups/s (%" PRIu64 "/%" PRIu64 " found)\n",
+		       threads, threads * n / elapsed / 1e6, found, threads * n);
+	}
+
+	sharedFree(&t);
+}
+
+/*
+ * False positive rate against space for a cuckoo filter filled until an
+ * insert fails, next to the best a Bloom filter could do with the same bits per
+ * entry, 0.6185^bits.
+ */
+static void
+benchFilter(uint8_t *keys, uint64_t n)
+{
+	int fpBits;
+
+	for (fpBits = 4; fpBits <= 16; fpBits += 2) {
+		CuckooFilter *f = filterAlloc(n / 4, fpBits);
+		uint64_t inserted, hits = 0, i;
+
+		double start = now();
+		for (inserted = 0; inserted < n / 2; inserted++) {
+			if (filterInsert(f, keys + inserted * KEY_LEN, KEY_LEN) != 0) {
+				break;
+			}
+		}
+		double insert = now() - start;
+
+		start = now();
+		for (i = n / 2; i < n; i++) {
+			hits += filterContains(f, keys + i * KEY_LEN, KEY_LEN);
+		}
+		double lookup = now() - start;
+
+		double bits = filterBitsPerEntry(f);
+		printf("%2d bit fingerprints: load %.3f, %5.2f bits/entry, %8.4f%% false positives "
+		       "(Bloom %8.4f%%), insert %5.1f ns, lookup %5.1f ns\n",
+		       fpBits, filterLoadFactor(f), bits, 100.0 * hits / (n - n / 2),
+		       100 * pow(0.6185, bits), insert * 1e9 / inserted, lookup * 1e9 / (n - n / 2));
+
+		filterFree(&f);
+	}
+}
+
+/*
+ * Starting up from a saved image against rebuilding the table by inserting
+ * every key again. The image was just written, so its pages are in the page
+ * cache and faulting them in is cheap; from disk it'd be slower.
+ */
+static void
+benchImage(uint64_t n)
+{
+	uint64_t *keys = malloc(n * sizeof(*keys));
+	char path[64];
+	uint64_t i, found = 0;
+
+	snprintf(path, sizeof(path), "/tmp/cuckoo-bench-%d.img", (int)getpid());
+
+	double start = now();
+	CuckooTable *t = cuckooAlloc(4, NULL);
+	cuckooSetInlineKeys(t);
+	for (i = 0; i < n; i++) {
+		keys[i] = i * 0x9e3779b97f4a7c15ULL;
+		cuckooInsert(t, keys + i, sizeof(*keys), (void *)(uintptr_t)(i + 1));
+	}
+	double rebuild = now() - start;
+
+	start = now();
+	cuckooSave(t, path, NULL);
+	double save = now() - start;
+	uint64_t bytes = t->size * t->slotSize;
+	cuckooFree(&t);
+
+	start = now();
+	t = cuckooOpenMapped(path, NULL, 0);
+	double open = now() - start;
+
+	start = now();
+	for (i = 0; i < 1000; i++) {
+		found += cuckooLookup(t, keys + i * (n / 1000), sizeof(*keys)) != NULL;
+	}
+	double first = now() - start;
+
+	start = now();
+	for (i = 0; i < n; i++) {
+		found += cuckooLookup(t, keys + i, sizeof(*keys)) != NULL;
+	}
+	double all = now() - start;
+	cuckooFree(&t);
+
+	start = now();
+	t = cuckooOpenMapped(path, NULL, 1);
+	double verify = now() - start;
+	cuckooFree(&t);
+
+	printf("rebuild %.3f s, save %.3f s (%" PRIu64 " MB)\n", rebuild, save, bytes >> 20);
+	printf("open %.6f s, verified %.3f s, first 1000 lookups %.6f s, all keys %.3f s, %" PRIu64 "/%" PRIu64 " found\n",
+	       open, verify, first, all, found, n + 1000);
+
+	unlink(path);
+	free(keys);
+}
+
+/*
+ * Loading a table with cuckooBuild() against inserting its keys one at a
+ * time. Building just under half full ends up with the same size table.
+ */
+static void
+benchBuild(uint64_t n)
+{
+	uint64_t *keys = malloc(n * sizeof(*keys));
+	void **ptrs = malloc(n * sizeof(*ptrs));
+	uint64_t *lens = malloc(n * sizeof(*lens));
+	uint64_t i, found = 0;
+
+	for (i = 0; i < n; i++) {
+		keys[i] = i * 0x9e3779b97f4a7c15ULL;
+		ptrs[i] = keys + i;
+		lens[i] = sizeof(*keys);
+	}
+
+	double start = now();
+	CuckooTable *t = cuckooAlloc(4, NULL);
+	cuckooSetInlineKeys(t);
+	for (i = 0; i < n; i++) {
+		cuckooInsert(t, keys + i, sizeof(*keys), NULL);
+	}
+	double insert = now() - start;
+	printf("insert %.3f s, %" PRIu64 " slots, load %.2f\n", insert, t->size, (double)t->count / t->size);
+	cuckooFree(&t);
+
+	start = now();
+	t = cuckooBuild(ptrs, lens, NULL, n, 0.49, 1);
+	double build = now() - start;
+	for (i = 0; i < n; i++) {
+		found += cuckooLookup(t, keys + i, sizeof(*keys)) != NULL;
+	}
+	printf("build  %.3f s, %" PRIu64 " slots, load %.2f, %" PRIu64 "/%" PRIu64 " found\n",
+	       build, t->size, (double)t->count / t->size, found, n);
+	cuckooFree(&t);
+
+	free(lens);
+	free(ptrs);
+	free(keys);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t n = 1000000;
+	uint8_t *keys = benchKeys(n);
+
+	/*
+	 * The biggest table for the batched lookups, in MB.
+	 */
+	uint64_t maxMB = argc > 1 ? strtoull(argv[1], NULL, 0) : 1024;
+
+	printf("Hashing %d byte keys\n", KEY_LEN);
+	benchHash("poly", cuckooPolyHash, keys, n);
+	benchHash("fast", cuckooFastHash, keys, n);
+
+	printf("\nCuckooTable, %" PRIu64 " keys\n", n);
+	benchTable("poly", cuckooPolyHash, keys, n);
+	benchTable("fast", cuckooFastHash, keys, n);
+	benchBucket(keys, n);
+
+	printf("\nCuckooTable, %" PRIu64 " keys one at a time\n", n);
+	benchInsertLatency(keys, n);
+
+	printf("\nCuckooTable, %" PRIu64 " keys loaded at once\n", 4 * n);
+	benchBuild(4 * n);
+
+	printf("\nCuckooTable keys, %" PRIu64 " keys, random order lookups\n", n);
+	benchInline(n);
+
+	printf("\nCuckooTable lookups, one at a time and batched\n");
+	benchBatch(maxMB << 20);
+
+	printf("\nCuckooTable image, %" PRIu64 " keys\n", 4 * n);
+	benchImage(4 * n);
+
+	printf("\nCuckooFilter, sized for %" PRIu64 " keys and filled until full\n", n / 4);
+	benchFilter(keys, n);
+
+	printf("\nSharedTable, %" PRIu64 " keys\n", n);
+	benchShared(keys, n);
+
+	free(keys);
+
+	return 0;
+}
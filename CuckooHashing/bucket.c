@@ -0,0 +1,326 @@
+#include "bucket.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef DEBUG
+#define debug(...) printf(__VA_ARGS__)
+#else
+#define debug(...)
+#endif
+
+static inline uint64_t
+bucketHash(void *key, uint64_t len)
+{
+	uint64_t hash[2];
+	cuckooFastHash(key, len, 0, hash);
+	return hash[0];
+}
+
+/*
+ * The bucket index comes from the low bits of the hash and the fingerprint
+ * from the high bits. 0 marks an empty slot, so it's never a fingerprint.
+ */
+static inline uint16_t
+fingerprint(uint64_t hash)
+{
+	uint16_t fp = hash >> 48;
+	return fp ? fp : 1;
+}
+
+static inline uint64_t
+altBucket(BucketTable *t, uint64_t b, uint16_t fp)
+{
+	return cuckooAltBucket(b, fp, t->numBuckets);
+}
+
+/*
+ * Bit 2*i of the result is set when tag[i] == fp.
+ */
+static inline unsigned
+tagMatch(BucketTags *b, uint16_t fp)
+{
+#ifdef __SSE2__
+	__m128i tags = _mm_load_si128((__m128i *)b->tag);
+	__m128i eq = _mm_cmpeq_epi16(tags, _mm_set1_epi16(fp));
+	return _mm_movemask_epi8(eq) & 0x5555;
+#else
+	unsigned mask = 0;
+	int i;
+	for (i = 0; i < BUCKET_WAYS; i++) {
+		mask |= (unsigned)(b->tag[i] == fp) << (2 * i);
+	}
+	return mask;
+#endif
+}
+
+static inline int
+nextWay(unsigned *mask)
+{
+	int way = __builtin_ctz(*mask) >> 1;
+	*mask &= *mask - 1;
+	return way;
+}
+
+static inline uint64_t
+nextRandom(BucketTable *t)
+{
+	t->rng ^= t->rng << 13;
+	t->rng ^= t->rng >> 7;
+	t->rng ^= t->rng << 17;
+	return t->rng;
+}
+
+static CuckooElement *
+findSlot(BucketTable *t, void *key, uint64_t len, uint64_t hash)
+{
+	uint16_t fp = fingerprint(hash);
+	uint64_t b[2];
+
+	b[0] = hash & (t->numBuckets - 1);
+	b[1] = altBucket(t, b[0], fp);
+	__builtin_prefetch(t->tags + b[1]);
+
+	int i;
+	for (i = 0; i < 2; i++) {
+		unsigned mask = tagMatch(t->tags + b[i], fp);
+		while (mask) {
+			CuckooElement *e = t->slots + b[i] * BUCKET_WAYS + nextWay(&mask);
+			if (e->len == len && memcmp(e->key, key, len) == 0) {
+				return e;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static inline int
+storeIfFree(BucketTable *t, uint64_t b, CuckooElement *e, uint16_t fp)
+{
+	unsigned mask = tagMatch(t->tags + b, 0);
+	if (mask == 0) {
+		return 1;
+	}
+
+	int way = nextWay(&mask);
+	t->tags[b].tag[way] = fp;
+	t->slots[b * BUCKET_WAYS + way] = *e;
+	return 0;
+}
+
+/*
+ * Put 'e' in one of its two buckets, kicking other elements to their other
+ * bucket as needed.
+ *
+ * 0 success
+ * 1 gave up, 'e' now holds whichever element was left without a slot
+ */
+static int
+place(BucketTable *t, CuckooElement *e, uint64_t hash)
+{
+	uint16_t fp = fingerprint(hash);
+	uint64_t b = hash & (t->numBuckets - 1);
+
+	if (storeIfFree(t, b, e, fp) == 0) {
+		return 0;
+	}
+	b = altBucket(t, b, fp);
+
+	int kicks;
+	for (kicks = 0; kicks < CUCKOO_MAX_KICKS; kicks++) {
+		if (storeIfFree(t, b, e, fp) == 0) {
+			return 0;
+		}
+
+		/*
+		 * Both buckets are full. Swap with a random victim in this one and
+		 * carry the victim over to its other bucket.
+		 */
+		int way = nextRandom(t) % BUCKET_WAYS;
+		CuckooElement *slot = t->slots + b * BUCKET_WAYS + way;
+		CuckooElement victim = *slot;
+		uint16_t victimFp = t->tags[b].tag[way];
+
+		*slot = *e;
+		t->tags[b].tag[way] = fp;
+		*e = victim;
+		fp = victimFp;
+		b = altBucket(t, b, fp);
+	}
+
+	debug("Gave up after %d kicks\n", kicks);
+	return 1;
+}
+
+static int
+allocBuckets(BucketTable *t, uint64_t numBuckets)
+{
+	t->tags = aligned_alloc(64, numBuckets * sizeof(*t->tags));
+	t->slots = calloc(numBuckets * BUCKET_WAYS, sizeof(*t->slots));
+	if (t->tags == NULL || t->slots == NULL) {
+		free(t->tags);
+		free(t->slots);
+		return 1;
+	}
+	memset(t->tags, 0, numBuckets * sizeof(*t->tags));
+	t->numBuckets = numBuckets;
+	return 0;
+}
+
+/*
+ * Move everything, plus the homeless 'extra' element, into 'numBuckets'
+ * buckets. The old arrays are only released once every element has found a
+ * slot, so a failed attempt can be retried with more buckets.
+ *
+ * 0 success
+ * 1 something didn't fit
+ */
+static int
+bucketResize(BucketTable *t, uint64_t numBuckets, CuckooElement *extra)
+{
+	BucketTable old = *t;
+
+	debug("Resize to %" PRIu64 " buckets\n", numBuckets);
+
+	if (allocBuckets(t, numBuckets) != 0) {
+		fprintf(stderr, "Can't allocate %" PRIu64 " buckets\n", numBuckets);
+		abort();
+	}
+
+	uint64_t i;
+	for (i = 0; i < old.numBuckets * BUCKET_WAYS; i++) {
+		CuckooElement e = old.slots[i];
+		if (old.tags[i / BUCKET_WAYS].tag[i % BUCKET_WAYS] == 0) {
+			continue;
+		}
+		if (place(t, &e, bucketHash(e.key, e.len)) != 0) {
+			goto FAIL;
+		}
+	}
+	CuckooElement e = *extra;
+	if (place(t, &e, bucketHash(e.key, e.len)) != 0) {
+		goto FAIL;
+	}
+
+	free(old.tags);
+	free(old.slots);
+	return 0;
+
+FAIL:
+	free(t->tags);
+	free(t->slots);
+	t->tags = old.tags;
+	t->slots = old.slots;
+	t->numBuckets = old.numBuckets;
+	return 1;
+}
+
+BucketTable *
+bucketAlloc(uint64_t initialSize, CuckooDeleteCallback deleteCallback)
+{
+	BucketTable *t;
+	uint64_t numBuckets = 4;
+
+	while (numBuckets * BUCKET_WAYS < initialSize) {
+		numBuckets *= 2;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL || allocBuckets(t, numBuckets) != 0) {
+		free(t);
+		return NULL;
+	}
+	t->rng = 0x9e3779b97f4a7c15ULL;
+	t->deleteCallback = deleteCallback;
+
+	return t;
+}
+
+int
+bucketInsert(BucketTable *t, void *key, uint64_t len, void *data)
+{
+	uint64_t hash = bucketHash(key, len);
+
+	if (findSlot(t, key, len, hash) != NULL) {
+		/*
+		 * It's already in the table.
+		 */
+		return 0;
+	}
+
+	CuckooElement e = {key, len, data};
+	if (place(t, &e, hash) == 0) {
+		t->count++;
+		return 0;
+	}
+
+	uint64_t numBuckets = t->numBuckets * 2;
+	while (bucketResize(t, numBuckets, &e) != 0) {
+		numBuckets *= 2;
+	}
+	t->count++;
+
+	return 1;
+}
+
+CuckooElement *
+bucketLookup(BucketTable *t, void *key, uint64_t len)
+{
+	return findSlot(t, key, len, bucketHash(key, len));
+}
+
+void *
+bucketDelete(BucketTable *t, void *key, uint64_t len, CuckooDeleteCallback deleteCallback)
+{
+	CuckooElement *e = bucketLookup(t, key, len);
+	if (e == NULL) {
+		return NULL;
+	}
+
+	uint64_t i = e - t->slots;
+	void *data = e->data;
+	if (deleteCallback) {
+		deleteCallback(e);
+	}
+	memset(e, 0, sizeof(*e));
+	t->tags[i / BUCKET_WAYS].tag[i % BUCKET_WAYS] = 0;
+	t->count--;
+
+	return data;
+}
+
+double
+bucketLoadFactor(BucketTable *t)
+{
+	return (double)t->count / (t->numBuckets * BUCKET_WAYS);
+}
+
+void
+bucketFree(BucketTable **t)
+{
+	if (t == NULL || *t == NULL) {
+		return;
+	}
+
+	uint64_t i;
+	for (i = 0; i < (*t)->numBuckets * BUCKET_WAYS; i++) {
+		if ((*t)->tags[i / BUCKET_WAYS].tag[i % BUCKET_WAYS] == 0) {
+			continue;
+		}
+		if ((*t)->deleteCallback) {
+			(*t)->deleteCallback((*t)->slots + i);
+		}
+	}
+
+	free((*t)->tags);
+	free((*t)->slots);
+	free(*t);
+	*t = NULL;
+}
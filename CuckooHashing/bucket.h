@@ -0,0 +1,60 @@
+#ifndef __BUCKET_H
+#define __BUCKET_H
+
+#include <inttypes.h>
+
+#include "cuckoo.h"
+
+/*
+ * A set associative cuckoo table. Every key hashes to two buckets of
+ * BUCKET_WAYS slots, so an insert only has to kick an element out when all
+ * of its candidate slots are taken. That pushes the usable load factor well
+ * past 90%, where one slot per bucket tops out around 50%.
+ *
+ * Each slot has a 16 bit fingerprint of its key. The fingerprints of a
+ * bucket are packed into 16 bytes and compared against the key's in one SIMD
+ * instruction; a key is only dereferenced when its fingerprint matches,
+ * which for a miss happens about once every 8000 lookups. The fingerprints
+ * live in their own array, four buckets to a cache line, so a lookup reads
+ * at most two cache lines before it finds the one slot worth checking.
+ */
+
+#define BUCKET_WAYS 8
+
+typedef struct BucketTags {
+	uint16_t tag[BUCKET_WAYS];
+} BucketTags;
+
+typedef struct BucketTable {
+	BucketTags *tags;
+	CuckooElement *slots;
+	uint64_t numBuckets;
+	uint64_t count;
+	uint64_t rng;
+	CuckooDeleteCallback deleteCallback;
+} BucketTable;
+
+/*
+ * 'initialSize' is the number of slots. It's rounded up so the number of
+ * buckets is a power of two.
+ */
+BucketTable *bucketAlloc(uint64_t initialSize, CuckooDeleteCallback deleteCallback);
+
+/*
+ * 0 success
+ * 1 resized
+ */
+int bucketInsert(BucketTable *t, void *key, uint64_t len, void *data);
+
+CuckooElement *bucketLookup(BucketTable *t, void *key, uint64_t len);
+
+/*
+ * Returns the data of the removed element, or NULL if the key isn't in the
+ * table.
+ */
+void *bucketDelete(BucketTable *t, void *key, uint64_t len, CuckooDeleteCallback deleteCallback);
+
+double bucketLoadFactor(BucketTable *t);
+void bucketFree(BucketTable **t);
+
+#endif /* __BUCKET_H */
@@ -1,10 +1,18 @@
+#define _GNU_SOURCE
 #include "cuckoo.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
-#include <math.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifdef DEBUG
 #define debug(...) printf(__VA_ARGS__)
@@ -12,49 +20,184 @@
 #define debug(...)
 #endif
 
-static uint64_t
-polyHash(void *key, uint64_t len, uint64_t p, uint64_t M)
+/*
+ * How many slots of the old array every insert or delete moves over while
+ * the table is growing. The new array is twice the size, so this easily
+ * empties the old one before the new one fills up.
+ */
+#define MIGRATE_STEP 8
+
+/*
+ * Keys too long to store inline are copied into chunks of at least this
+ * many bytes.
+ */
+#define ARENA_CHUNK (1 << 20)
+
+typedef struct CuckooArena {
+	struct CuckooArena *next;
+	uint64_t used;
+	uint64_t size;
+	uint8_t data[];
+} CuckooArena;
+
+static void *
+cuckooArenaCopy(CuckooArena **arena, void *key, uint64_t len)
 {
-	uint64_t hash = 0;
-	int i;
-	for (i = len-1; i >=0; i--) {
-		hash = (hash * p + ((uint8_t *)key)[i]) % M;
+	CuckooArena *a = *arena;
+
+	if (a == NULL || a->size - a->used < len) {
+		uint64_t size = len > ARENA_CHUNK ? len : ARENA_CHUNK;
+		a = malloc(sizeof(*a) + size);
+		if (a == NULL) {
+			fprintf(stderr, "Can't allocate a %" PRIu64 " byte key arena\n", size);
+			abort();
+		}
+		a->next = *arena;
+		a->used = 0;
+		a->size = size;
+		*arena = a;
 	}
-	return hash;
+
+	void *p = a->data + a->used;
+	memcpy(p, key, len);
+	a->used += len;
+	return p;
 }
 
-#define PRIME1 3851
-#define PRIME2 7477
+/*
+ * A zeroed array of 'size' slots. calloc() gets big arrays straight from
+ * the kernel, whose pages are only zeroed when they're first touched, so
+ * starting to grow doesn't stall on clearing the new array.
+ *
+ * Inline slots are a cache line each, so their array is lined up with the
+ * cache lines. The pointer calloc() returned is kept just below it for
+ * cuckooArrayFree().
+ */
+static CuckooElement *
+cuckooArray(uint64_t size, uint64_t slotSize)
+{
+	uint8_t *raw, *table;
 
-static uint64_t
-h1(void *key, uint64_t len, uint64_t M)
+	if (slotSize != sizeof(CuckooInlineElement)) {
+		raw = table = calloc(size, slotSize);
+	} else {
+		raw = calloc(1, size * slotSize + 64);
+		table = (uint8_t *)(((uintptr_t)raw + 64) & ~(uintptr_t)63);
+	}
+	if (raw == NULL) {
+		fprintf(stderr, "Can't allocate %" PRIu64 " slots\n", size);
+		abort();
+	}
+	if (table != raw) {
+		((void **)table)[-1] = raw;
+	}
+	return (CuckooElement *)table;
+}
+
+static void
+cuckooArrayFree(CuckooTable *t, CuckooElement *table)
 {
-	return polyHash(key, len, PRIME1, M);
+	if (table != NULL && t->slotSize == sizeof(CuckooInlineElement)) {
+		table = ((void **)table)[-1];
+	}
+	free(table);
 }
 
-static uint64_t
-h2(void *key, uint64_t len, uint64_t M)
+static inline CuckooElement *
+cuckooSlot(CuckooTable *t, CuckooElement *table, uint64_t i)
 {
-	/*
-	 * h1(x) -> [0,M-1]
-	 * h2(x) = h1(x) + [1,M-2]
-	 */
-	return (h1(key, len, M) + polyHash(key, len, PRIME2, M-2) + 1) % M;
+	return (CuckooElement *)((uint8_t *)table + i * t->slotSize);
+}
+
+static inline CuckooElement *
+cuckooStashSlot(CuckooTable *t, int i)
+{
+	return &t->stash[i].e;
+}
+
+/*
+ * Copy a slot, pointing an inline key at the copy's own bytes.
+ */
+static inline void
+cuckooCopy(CuckooTable *t, CuckooElement *dst, CuckooElement *src)
+{
+	memcpy(dst, src, t->slotSize);
+	if (t->inlineKeys && src->key == ((CuckooInlineElement *)src)->key) {
+		dst->key = ((CuckooInlineElement *)dst)->key;
+	}
+}
+
+/*
+ * Inline key tables keep the low 32 bits of both hashes, which covers every
+ * bucket of a table of up to CUCKOO_INLINE_MAX_SLOTS slots.
+ */
+static inline uint64_t
+cuckooPackHash(uint64_t hash[2])
+{
+	return (uint32_t)hash[0] | (hash[1] << 32);
+}
+
+/*
+ * A key's buckets in an array of 'size' slots. The two are kept apart so an
+ * element always has somewhere else to go.
+ */
+static inline void
+cuckooMask(uint64_t hash[2], uint64_t size, uint64_t b[2])
+{
+	b[0] = hash[0] & (size - 1);
+	b[1] = hash[1] & (size - 1);
+	if (b[1] == b[0]) {
+		b[1] ^= 1;
+	}
 }
 
-typedef uint64_t (*hashFunction)(void *key, uint64_t len, uint64_t tableSize);
-hashFunction hashFuncs[2] = {h1, h2};
+/*
+ * The hashes of an element that's already in the table. With inline keys
+ * they're stored next to it, otherwise the key is hashed again.
+ */
+static inline void
+cuckooElementHash(CuckooTable *t, CuckooElement *e, uint64_t hash[2])
+{
+	if (t->inlineKeys) {
+		uint64_t h = ((CuckooInlineElement *)e)->hash;
+		hash[0] = (uint32_t)h;
+		hash[1] = h >> 32;
+	} else {
+		t->hashFunc(e->key, e->len, t->seed, hash);
+	}
+}
+
+static inline uint64_t
+cuckooNanos(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Where an element's key is. 'base' is NULL unless the table is mapped, so
+ * this is just 'e->key' for the others.
+ */
+static inline void *
+cuckooKeyAt(CuckooTable *t, CuckooElement *e)
+{
+	return (void *)((uintptr_t)t->base + (uintptr_t)e->key);
+}
 
 /*
  * 0 exact match
  * 1 they differ
  */
 static inline int
-cuckooCompare(CuckooElement *e, void *key, uint64_t len)
+cuckooCompare(CuckooTable *t, CuckooElement *e, void *key, uint64_t len, uint64_t hash[2])
 {
+	if (t->inlineKeys && ((CuckooInlineElement *)e)->hash != cuckooPackHash(hash)) {
+		return 1;
+	}
 	if ((e->key != NULL) &&
 		(len == e->len) &&
-		(memcmp(key, e->key, len) == 0)) {
+		(memcmp(key, cuckooKeyAt(t, e), len) == 0)) {
 		return 0;
 	}
 	return 1;
@@ -69,44 +212,202 @@ cuckooStore(CuckooElement *e, void *key, uint64_t len, void *data)
 }
 
 /*
- * 0 Success
- * 1 Need to resize table
+ * Fill in a new element for 'key'. With inline keys, short keys are copied
+ * into the element and longer ones into 'arena'.
+ */
+static void
+cuckooMakeElement(CuckooTable *t, CuckooArena **arena, CuckooInlineElement *n, void *key, uint64_t len,
+                  void *data, uint64_t hash[2])
+{
+	cuckooStore(&n->e, key, len, data);
+	if (!t->inlineKeys) {
+		return;
+	}
+
+	n->hash = cuckooPackHash(hash);
+	if (len <= CUCKOO_INLINE_KEY) {
+		memcpy(n->key, key, len);
+		n->e.key = n->key;
+	} else {
+		n->e.key = cuckooArenaCopy(arena, key, len);
+	}
+}
+
+/*
+ * How many slots the eviction search may look at before the element goes in
+ * the stash instead.
+ */
+#define MAX_SEARCH 512
+
+typedef struct PathNode {
+	uint64_t slot;
+	int parent;
+} PathNode;
+
+/*
+ * Where the element in slot 'slot' would go if it were kicked out.
+ */
+static inline uint64_t
+cuckooOther(CuckooTable *t, uint64_t slot)
+{
+	uint64_t hash[2], b[2];
+
+	cuckooElementHash(t, cuckooSlot(t, t->table, slot), hash);
+	cuckooMask(hash, t->size, b);
+	return b[0] == slot ? b[1] : b[0];
+}
+
+/*
+ * Breadth first search from both of a key's buckets for the nearest free
+ * slot. Nothing is moved while searching, so a failed search leaves the
+ * table as it was.
+ *
+ * On success returns the index in 'queue' of the free slot; following the
+ * parents from there leads back to one of the key's buckets.
+ * -1 if there's no free slot within MAX_SEARCH slots
  */
 static int
-cuckooEvict(CuckooTable *t, CuckooElement *e, uint64_t c)
+cuckooFindPath(CuckooTable *t, uint64_t b[2], PathNode *queue)
 {
-	CuckooElement *other;
+	int head = 0, tail = 0;
 
-	if (c >= (uint64_t)log2(t->size)) {
-		debug("Need to resize the table!\n");
-		return 1;
+	queue[tail++] = (PathNode){b[0], -1};
+	queue[tail++] = (PathNode){b[1], -1};
+
+	for (head = 0; head < tail; head++) {
+		if (cuckooSlot(t, t->table, queue[head].slot)->key == NULL) {
+			return head;
+		}
+		if (tail < MAX_SEARCH) {
+			queue[tail++] = (PathNode){cuckooOther(t, queue[head].slot), head};
+		}
+	}
+
+	debug("No free slot within %d slots\n", MAX_SEARCH);
+	return -1;
+}
+
+/*
+ * Shift every element on the path one step towards the free slot at its
+ * end, starting from the free slot so nothing is overwritten. Returns the
+ * slot at the start of the path, which is now free.
+ */
+static uint64_t
+cuckooMovePath(CuckooTable *t, PathNode *queue, int end)
+{
+	int i, kicks = 0;
+	for (i = end; queue[i].parent >= 0; i = queue[i].parent) {
+		cuckooCopy(t, cuckooSlot(t, t->table, queue[i].slot),
+		           cuckooSlot(t, t->table, queue[queue[i].parent].slot));
+		kicks++;
+	}
+	t->stats.kicks[kicks < CUCKOO_KICK_BUCKETS ? kicks : CUCKOO_KICK_BUCKETS - 1]++;
+	return queue[i].slot;
+}
+
+/*
+ * Try to move stashed elements into the table. Called when a slot frees up.
+ */
+static void
+cuckooDrainStash(CuckooTable *t)
+{
+	int i = 0;
+	while (i < t->stashCount) {
+		CuckooElement *s = cuckooStashSlot(t, i);
+		CuckooElement *slot = NULL;
+		uint64_t hash[2], b[2];
+
+		cuckooElementHash(t, s, hash);
+		cuckooMask(hash, t->size, b);
+
+		int j;
+		for (j = 0; j < 2 && slot == NULL; j++) {
+			if (cuckooSlot(t, t->table, b[j])->key == NULL) {
+				slot = cuckooSlot(t, t->table, b[j]);
+			}
+		}
+		if (slot == NULL) {
+			i++;
+			continue;
+		}
+
+		cuckooCopy(t, slot, s);
+		if (i != --t->stashCount) {
+			cuckooCopy(t, s, cuckooStashSlot(t, t->stashCount));
+		}
 	}
+}
+
+/*
+ * Put an element that isn't in the table yet into the current array, or the
+ * stash if there's no path to a free slot.
+ *
+ * 0 success
+ * 1 no room
+ */
+static int
+cuckooPlace(CuckooTable *t, CuckooElement *e, uint64_t hash[2])
+{
+	PathNode queue[MAX_SEARCH];
+	uint64_t b[2];
 
+	cuckooMask(hash, t->size, b);
+
+	/*
+	 * Check for a free bucket.
+	 */
 	int i;
 	for (i = 0; i < 2; i++) {
-		other = t->table + hashFuncs[i](e->key, e->len, t->size);
-		if (e != other) {
-			/*
-			 * Move key/value to this spot.
-			 */
-			if (other->key != NULL) {
-				if (cuckooEvict(t, other, c+1) > 0) {
-					return 1;
-				}
-			}
-			cuckooStore(other, e->key, e->len, e->data);
-			cuckooStore(e, NULL, 0, NULL);
+		if (cuckooSlot(t, t->table, b[i])->key == NULL) {
+			debug("Bucket %d is free\n", i);
+			cuckooCopy(t, cuckooSlot(t, t->table, b[i]), e);
+			t->stats.kicks[0]++;
 			return 0;
 		}
 	}
 
 	/*
-	 * If we get here, both hash functions mapped to the same value.
-	 * That should never happen!
+	 * Go cuckoo. If no path is short enough, park the element in the stash.
 	 */
-	abort();
+	int end = cuckooFindPath(t, b, queue);
+	if (end >= 0) {
+		uint64_t slot = cuckooMovePath(t, queue, end);
+		cuckooCopy(t, cuckooSlot(t, t->table, slot), e);
+		return 0;
+	}
+	if (t->stashCount < CUCKOO_STASH_SIZE) {
+		debug("Stash %d\n", t->stashCount);
+		cuckooCopy(t, cuckooStashSlot(t, t->stashCount++), e);
+		t->stats.stashed++;
+		return 0;
+	}
+
+	return 1;
+}
+
+static void cuckooGrow(CuckooTable *t);
+
+/*
+ * Put an element that was already in the table back in, growing it if
+ * there's no room.
+ */
+static void
+cuckooReinsert(CuckooTable *t, CuckooElement *e)
+{
+	uint64_t hash[2];
+
+	cuckooElementHash(t, e, hash);
+	while (cuckooPlace(t, e, hash) != 0) {
+		cuckooGrow(t);
+	}
+	t->count++;
 }
 
+/*
+ * Rebuild the whole table into a new array in one go, finishing any growth
+ * in progress. Only used when the new array fills up before the old one has
+ * been emptied, which takes a very unlucky run of kicks.
+ */
 static int
 cuckooResize(CuckooTable *t, uint64_t newSize)
 {
@@ -114,142 +415,1210 @@ cuckooResize(CuckooTable *t, uint64_t newSize)
 		debug("The table size must be 2 or greater.\n");
 		abort();
 	}
-	debug("Resize to %" PRIu64 "\n", t->size * 2);
+	if (t->inlineKeys && newSize > CUCKOO_INLINE_MAX_SLOTS) {
+		fprintf(stderr, "Can't resize an inline key table to %" PRIu64 " slots\n", newSize);
+		abort();
+	}
+	debug("Resize to %" PRIu64 "\n", newSize);
+	t->stats.rebuilds++;
 
-	CuckooElement *oldTable = t->table;
-	uint64_t oldSize = t->size;
-	t->table = calloc(newSize, sizeof(*t->table));
-	t->size = newSize;
+	CuckooElement *table = t->table;
+	uint64_t size = t->size;
+	CuckooElement *oldTable = t->oldTable;
+	uint64_t oldSize = t->oldSize;
+	CuckooInlineElement stash[CUCKOO_STASH_SIZE];
+	int stashCount = t->stashCount;
 
 	int i;
+	for (i = 0; i < stashCount; i++) {
+		cuckooCopy(t, &stash[i].e, cuckooStashSlot(t, i));
+	}
+	t->table = cuckooArray(newSize, t->slotSize);
+	t->size = newSize;
+	t->count = 0;
+	t->stashCount = 0;
+	t->oldTable = NULL;
+	t->oldSize = 0;
+	t->migrated = 0;
+
+	for (i = 0; i < size; i++) {
+		CuckooElement *e = cuckooSlot(t, table, i);
+		if (e->key == NULL) {
+			continue;
+		}
+
+		cuckooReinsert(t, e);
+	}
 	for (i = 0; i < oldSize; i++) {
-		CuckooElement *e = oldTable + i;
+		CuckooElement *e = cuckooSlot(t, oldTable, i);
 		if (e->key == NULL) {
 			continue;
 		}
 
-		cuckooInsert(t, e->key, e->len, e->data);
+		cuckooReinsert(t, e);
+	}
+	for (i = 0; i < stashCount; i++) {
+		cuckooReinsert(t, &stash[i].e);
 	}
 
-	free(oldTable);
+	cuckooArrayFree(t, table);
+	cuckooArrayFree(t, oldTable);
 
 	return 0;
 }
 
+/*
+ * Start growing the table. The current array becomes the old one, and its
+ * elements are moved over a few at a time by cuckooMigrate().
+ */
+static void
+cuckooGrow(CuckooTable *t)
+{
+	if (t->oldTable != NULL) {
+		cuckooResize(t, t->size * 2);
+		return;
+	}
+	if (t->inlineKeys && t->size * 2 > CUCKOO_INLINE_MAX_SLOTS) {
+		fprintf(stderr, "Can't grow an inline key table to %" PRIu64 " slots\n", t->size * 2);
+		abort();
+	}
+	debug("Grow to %" PRIu64 "\n", t->size * 2);
+	t->stats.grows++;
+
+	t->oldTable = t->table;
+	t->oldSize = t->size;
+	t->migrated = 0;
+	t->table = cuckooArray(t->size * 2, t->slotSize);
+	t->size *= 2;
+
+	if (t->stashCount > 0) {
+		cuckooDrainStash(t);
+	}
+}
+
+/*
+ * Move up to 'steps' slots of the old array into the current one.
+ */
+static void
+cuckooMigrate(CuckooTable *t, uint64_t steps)
+{
+	while (t->oldTable != NULL && steps-- > 0) {
+		CuckooElement *old = cuckooSlot(t, t->oldTable, t->migrated);
+
+		if (old->key != NULL) {
+			uint64_t hash[2];
+
+			cuckooElementHash(t, old, hash);
+			if (cuckooPlace(t, old, hash) != 0) {
+				uint64_t start = cuckooNanos();
+				cuckooResize(t, t->size * 2);
+				t->stats.resizeNanos += cuckooNanos() - start;
+				return;
+			}
+			cuckooStore(old, NULL, 0, NULL);
+		}
+
+		if (++t->migrated == t->oldSize) {
+			debug("Done growing to %" PRIu64 "\n", t->size);
+			cuckooArrayFree(t, t->oldTable);
+			t->oldTable = NULL;
+			t->oldSize = 0;
+			t->migrated = 0;
+		}
+	}
+}
+
 CuckooTable *
 cuckooAlloc(uint64_t initialSize, CuckooDeleteCallback deleteCallback)
 {
 	CuckooTable *t;
+	uint64_t size = 4;
 
 	if (initialSize < 4) {
 		debug("The table size must be 2 or greater.\n");
 		abort();
 	}
+	while (size < initialSize) {
+		size *= 2;
+	}
 
 	t = calloc(1, sizeof(*t));
-	t->table = calloc(initialSize, sizeof(*t->table));
-	t->size = initialSize;
+	t->slotSize = sizeof(CuckooElement);
+	t->table = cuckooArray(size, t->slotSize);
+	t->size = size;
+	t->hashFunc = cuckooFastHash;
 	t->deleteCallback = deleteCallback;
 
 	return t;
 }
 
-/*
- * 0 success
- * 1 would have resized
- */
 int
-cuckooInsert(CuckooTable *t, void *key, uint64_t len, void *data)
+cuckooSetHash(CuckooTable *t, CuckooHashFunction hashFunc, uint64_t seed)
 {
-	CuckooElement *e[2];
+	if (t == NULL || hashFunc == NULL) {
+		fprintf(stderr, "%s(%p, %p): Invalid arguments?!\n", __func__, t, hashFunc);
+		return -1;
+	}
+	if (t->count > 0) {
+		fprintf(stderr, "Can't change the hash of a table with %" PRIu64 " elements\n", t->count);
+		return -1;
+	}
 
-RETRY: ;
+	t->hashFunc = hashFunc;
+	t->seed = seed;
 
-	/*
-	 * See if it's already in the table.
-	 */
-	int i;
-	for (i = 0; i < 2; i++) {
-		e[i] = t->table + hashFuncs[i](key, len, t->size);
-		if (cuckooCompare(e[i], key, len) == 0) {
-			/*
-			 * It's already in the table.
-			 */
-			return 0;
-		}
+	return 0;
+}
+
+int
+cuckooSetInlineKeys(CuckooTable *t)
+{
+	if (t == NULL) {
+		fprintf(stderr, "%s(%p): Invalid arguments?!\n", __func__, t);
+		return -1;
 	}
+	if (t->count > 0 || t->oldTable != NULL || t->base != NULL) {
+		fprintf(stderr, "Can't change the keys of a table with %" PRIu64 " elements\n", t->count);
+		return -1;
+	}
+	if (t->inlineKeys) {
+		return 0;
+	}
+	if (t->size > CUCKOO_INLINE_MAX_SLOTS) {
+		fprintf(stderr, "Can't inline the keys of a table with %" PRIu64 " slots\n", t->size);
+		return -1;
+	}
+
+	CuckooElement *table = cuckooArray(t->size, sizeof(CuckooInlineElement));
+	cuckooArrayFree(t, t->table);
+	t->table = table;
+	t->slotSize = sizeof(CuckooInlineElement);
+	t->inlineKeys = 1;
+
+	return 0;
+}
+
+/*
+ * How many seeds cuckooBuild() tries at one size before doubling it, and
+ * how many doublings before it gives up.
+ */
+#define BUILD_SEEDS 8
+#define BUILD_DOUBLINGS 3
+
+/*
+ * The most threads cuckooBuild() uses, and the fewest keys worth giving a
+ * thread of its own.
+ */
+#define BUILD_THREADS 16
+#define BUILD_MIN_KEYS 65536
+
+/*
+ * A slot while working out where keys go. 'degree' counts the keys that
+ * could still go in it, 'keys' is the xor of their indexes and 'ends' the
+ * xor of their slot pairs (each key's two slots xored together). With only
+ * one key left, that gives the key and its other slot without looking at
+ * the key. Once the slot is taken, 'keys' is the key in it.
+ */
+typedef struct BuildSlot {
+	uint64_t keys;
+	uint64_t ends;
+	uint32_t degree;
+} BuildSlot;
+
+#define BUILD_TAKEN UINT32_MAX
+
+typedef struct CuckooBuild {
+	CuckooTable *t;
+	void **keys;
+	uint64_t *lens;
+	void **values;
+	uint64_t (*hash)[2];
+	BuildSlot *slots;
 
 	/*
-	 * Check for a free bucket.
+	 * This thread's share: keys while hashing, slots while filling.
 	 */
-	for (i = 0; i < 2; i++) {
-		if (e[i]->key == NULL) {
-			debug("Bucket %d is free\n", i);
-			cuckooStore(e[i], key, len, data);
-			return 0;
-		}
-	}
+	uint64_t start;
+	uint64_t end;
+	CuckooArena *arena;
 
 	/*
-	 * Go cuckoo.
+	 * Set when this thread's share holds two copies of a key.
 	 */
-	if (cuckooEvict(t, e[0], 0) > 0) {
-		cuckooResize(t, t->size * 2);
-		goto RETRY;
-	}
-	cuckooStore(e[0], key, len, data);
+	int hasDuplicate;
+	uint64_t duplicate;
+} CuckooBuild;
 
-	return 0;
-}
-
-CuckooElement *
-cuckooLookup(CuckooTable *t, void *key, uint64_t len)
+static void *
+cuckooBuildHash(void *arg)
 {
-	CuckooElement *e = NULL;
+	CuckooBuild *b = arg;
+	uint64_t i;
 
-	int i;
-	for (i = 0; i < 2; i++) {
-		e = t->table + hashFuncs[i](key, len, t->size);
-		if (cuckooCompare(e, key, len) == 0) {
-			/*
-			 * Found a match.
-			 */
-			return e;
-		}
+	for (i = b->start; i < b->end; i++) {
+		b->t->hashFunc(b->keys[i], b->lens[i], b->t->seed, b->hash[i]);
 	}
-
 	return NULL;
 }
 
-void *
-cuckooDelete(CuckooTable *t, void *key, uint64_t len, CuckooDeleteCallback deleteCallback)
+/*
+ * The table's pages are only zeroed as they're first touched, so that
+ * happens in parallel too, each thread on its own part.
+ */
+static void *
+cuckooBuildFill(void *arg)
 {
-	CuckooElement *e = cuckooLookup(t, key, len);
-	void *data = e->data;
-	if (deleteCallback) {
-		deleteCallback(e);
+	CuckooBuild *b = arg;
+	CuckooTable *t = b->t;
+	uint64_t v;
+
+	for (v = b->start; v < b->end; v++) {
+		if (b->slots[v].degree != BUILD_TAKEN) {
+			continue;
+		}
+
+		uint64_t i = b->slots[v].keys;
+		cuckooMakeElement(t, &b->arena, (CuckooInlineElement *)cuckooSlot(t, t->table, v),
+		                  b->keys[i], b->lens[i], b->values ? b->values[i] : NULL, b->hash[i]);
 	}
-	cuckooStore(e, NULL, 0, NULL);
-	return data;
+	return NULL;
 }
 
-void
+/*
+ * Two copies of a key have the same two slots, so once every key is placed
+ * they fill both of them. Check the key in each taken slot against the one
+ * in its other slot.
+ */
+static void *
+cuckooBuildCheck(void *arg)
+{
+	CuckooBuild *b = arg;
+	BuildSlot *slots = b->slots;
+	uint64_t v;
+
+	for (v = b->start; v < b->end; v++) {
+		uint64_t other = slots[v].ends ^ v;
+		if (slots[v].degree != BUILD_TAKEN || other <= v || slots[other].degree != BUILD_TAKEN) {
+			continue;
+		}
+
+		uint64_t i = slots[v].keys;
+		uint64_t j = slots[other].keys;
+		if (b->hash[i][0] == b->hash[j][0] && b->hash[i][1] == b->hash[j][1] &&
+		    b->lens[i] == b->lens[j] && memcmp(b->keys[i], b->keys[j], b->lens[i]) == 0) {
+			b->hasDuplicate = 1;
+			b->duplicate = j > i ? j : i;
+		}
+	}
+	return NULL;
+}
+
+typedef struct BuildKey {
+	uint64_t hash[2];
+	uint64_t i;
+} BuildKey;
+
+static int
+buildKeyCompare(const void *a, const void *b)
+{
+	const BuildKey *ka = a;
+	const BuildKey *kb = b;
+
+	if (ka->hash[0] != kb->hash[0]) {
+		return ka->hash[0] < kb->hash[0] ? -1 : 1;
+	}
+	if (ka->hash[1] != kb->hash[1]) {
+		return ka->hash[1] < kb->hash[1] ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * Look for a key that's in the keys more than once by sorting them by
+ * hash. Three or more copies of a key can't all be placed, so this is
+ * only worth doing when placement fails.
+ *
+ * Returns the index of a copy, or n if there are none.
+ */
+static uint64_t
+cuckooBuildFindDuplicate(CuckooBuild *b, uint64_t n)
+{
+	BuildKey *sorted = malloc(n * sizeof(*sorted));
+	uint64_t i, dup = n;
+
+	if (sorted == NULL) {
+		return n;
+	}
+	for (i = 0; i < n; i++) {
+		sorted[i] = (BuildKey){{b->hash[i][0], b->hash[i][1]}, i};
+	}
+	qsort(sorted, n, sizeof(*sorted), buildKeyCompare);
+
+	for (i = 1; i < n && dup == n; i++) {
+		uint64_t j, k = sorted[i].i;
+
+		/*
+		 * Compare against every earlier key with the same hashes.
+		 */
+		for (j = i; j-- > 0 && buildKeyCompare(sorted + j, sorted + i) == 0; ) {
+			uint64_t l = sorted[j].i;
+			if (b->lens[k] == b->lens[l] && memcmp(b->keys[k], b->keys[l], b->lens[k]) == 0) {
+				dup = k;
+				break;
+			}
+		}
+	}
+
+	free(sorted);
+	return dup;
+}
+
+/*
+ * Split [0, n) between 'threads' threads and run 'func' on each share. The
+ * calling thread takes the first share, and any share a thread can't be
+ * started for.
+ */
+static void
+cuckooBuildRun(CuckooBuild *work, int threads, uint64_t n, void *(*func)(void *))
+{
+	pthread_t tid[BUILD_THREADS];
+	int started[BUILD_THREADS] = {0};
+	int i;
+
+	for (i = 0; i < threads; i++) {
+		work[i].start = n * i / threads;
+		work[i].end = n * (i + 1) / threads;
+	}
+	for (i = 1; i < threads; i++) {
+		started[i] = pthread_create(tid + i, NULL, func, work + i) == 0;
+	}
+	func(work);
+	for (i = 1; i < threads; i++) {
+		if (started[i]) {
+			pthread_join(tid[i], NULL);
+		} else {
+			func(work + i);
+		}
+	}
+}
+
+/*
+ * Peel from the slots on 'queue': put the last key that could go in each
+ * one there and take it off its other slot's list, which may leave that
+ * slot with one key too. Returns how many keys were placed.
+ */
+static uint64_t
+cuckooBuildPeel(BuildSlot *slots, uint64_t *queue, uint64_t top)
+{
+	uint64_t placed = 0;
+
+	while (top > 0) {
+		uint64_t v = queue[--top];
+
+		/*
+		 * Most slots are still on the queue from the first pass and
+		 * long out of the cache.
+		 */
+		if (top > 16) {
+			__builtin_prefetch(slots + queue[top - 16], 1);
+		}
+		if (slots[v].degree != 1) {
+			continue;
+		}
+
+		uint64_t i = slots[v].keys;
+		uint64_t ends = slots[v].ends;
+		uint64_t other = ends ^ v;
+
+		slots[v].degree = BUILD_TAKEN;
+		placed++;
+
+		/*
+		 * The other slot is only taken already where a cycle was
+		 * broken.
+		 */
+		if (slots[other].degree == BUILD_TAKEN) {
+			continue;
+		}
+		slots[other].keys ^= i;
+		slots[other].ends ^= ends;
+		if (--slots[other].degree == 1) {
+			queue[top++] = other;
+		}
+	}
+
+	return placed;
+}
+
+/*
+ * Find a slot for every key by peeling the graph whose vertices are slots
+ * and whose edges join each key's two slots.
+ *
+ * What peeling leaves is cycles. Taking one key off its second slot's list
+ * breaks a cycle, and peeling then goes round it, ending with the key in
+ * its first slot. Anything else has more keys than slots.
+ *
+ * On success, 0 is returned and the taken 'b->slots' say which key goes
+ * where.
+ * On error, -1 is returned.
+ */
+static int
+cuckooBuildPlace(CuckooBuild *b, uint64_t n, uint64_t size, uint64_t *queue)
+{
+	uint64_t (*hash)[2] = b->hash;
+	BuildSlot *slots = b->slots;
+	uint64_t i, v, top = 0, placed;
+	uint64_t s[2];
+
+	memset(slots, 0, size * sizeof(*slots));
+
+	for (i = 0; i < n; i++) {
+		cuckooMask(hash[i], size, s);
+		slots[s[0]].keys ^= i;
+		slots[s[0]].ends ^= s[0] ^ s[1];
+		slots[s[0]].degree++;
+		slots[s[1]].keys ^= i;
+		slots[s[1]].ends ^= s[0] ^ s[1];
+		slots[s[1]].degree++;
+	}
+
+	for (v = 0; v < size; v++) {
+		if (slots[v].degree == 1) {
+			queue[top++] = v;
+		}
+	}
+	placed = cuckooBuildPeel(slots, queue, top);
+
+	for (i = 0; i < n && placed < n; i++) {
+		cuckooMask(hash[i], size, s);
+		if ((slots[s[0]].degree == BUILD_TAKEN && slots[s[0]].keys == i) ||
+		    (slots[s[1]].degree == BUILD_TAKEN && slots[s[1]].keys == i)) {
+			continue;
+		}
+		if (slots[s[0]].degree != 2 || slots[s[1]].degree != 2) {
+			debug("Key %" PRIu64 " isn't on a cycle\n", i);
+			return -1;
+		}
+
+		slots[s[1]].keys ^= i;
+		slots[s[1]].ends ^= s[0] ^ s[1];
+		slots[s[1]].degree--;
+		queue[0] = s[1];
+		placed += cuckooBuildPeel(slots, queue, 1);
+	}
+
+	return placed == n ? 0 : -1;
+}
+
+CuckooTable *
+cuckooBuild(void **keys, uint64_t *lens, void **values, uint64_t n, double targetLoad, int inlineKeys)
+{
+	CuckooBuild work[BUILD_THREADS];
+	CuckooTable *t = NULL;
+	uint64_t *queue = NULL;
+	uint64_t size = 4, attempt;
+	int i;
+
+	if ((n > 0 && (keys == NULL || lens == NULL)) || !(targetLoad > 0 && targetLoad < 0.5)) {
+		fprintf(stderr, "%s(%p, %p, %p, %" PRIu64 ", %f): Invalid arguments?!\n",
+		        __func__, keys, lens, values, n, targetLoad);
+		return NULL;
+	}
+	while (size * targetLoad < n) {
+		size *= 2;
+	}
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = cpus < 1 ? 1 : cpus > BUILD_THREADS ? BUILD_THREADS : cpus;
+	if (threads > n / BUILD_MIN_KEYS + 1) {
+		threads = n / BUILD_MIN_KEYS + 1;
+	}
+
+	t = calloc(1, sizeof(*t));
+	t->slotSize = inlineKeys ? sizeof(CuckooInlineElement) : sizeof(CuckooElement);
+	t->inlineKeys = inlineKeys;
+	t->hashFunc = cuckooFastHash;
+
+	for (i = 0; i < threads; i++) {
+		work[i] = (CuckooBuild){t, keys, lens, values};
+	}
+	work[0].hash = malloc(n * sizeof(*work[0].hash));
+	if (work[0].hash == NULL && n > 0) {
+		fprintf(stderr, "Can't allocate hashes for %" PRIu64 " keys\n", n);
+		goto error;
+	}
+
+	/*
+	 * Placement only needs the hashes, so try seeds and sizes until one
+	 * works before allocating the table.
+	 */
+	for (attempt = 0; ; attempt++) {
+		if (attempt == BUILD_SEEDS * (BUILD_DOUBLINGS + 1)) {
+			fprintf(stderr, "No placement for %" PRIu64 " keys up to %" PRIu64 " slots\n", n, size);
+			goto error;
+		}
+		if (attempt > 0 && attempt % BUILD_SEEDS == 0) {
+			size *= 2;
+		}
+		if (inlineKeys && size > CUCKOO_INLINE_MAX_SLOTS) {
+			fprintf(stderr, "Can't build an inline key table of %" PRIu64 " slots\n", size);
+			goto error;
+		}
+		if (attempt == 0 || attempt % BUILD_SEEDS == 0) {
+			free(work[0].slots);
+			free(queue);
+			work[0].slots = malloc(size * sizeof(*work[0].slots));
+			queue = malloc(size * sizeof(*queue));
+			if (work[0].slots == NULL || queue == NULL) {
+				fprintf(stderr, "Can't allocate placement for %" PRIu64 " slots\n", size);
+				goto error;
+			}
+		}
+		t->seed = attempt;
+		for (i = 1; i < threads; i++) {
+			work[i].hash = work[0].hash;
+			work[i].slots = work[0].slots;
+		}
+		cuckooBuildRun(work, threads, n, cuckooBuildHash);
+
+		if (cuckooBuildPlace(work, n, size, queue) == 0) {
+			break;
+		}
+		debug("No placement with seed %" PRIu64 " in %" PRIu64 " slots\n", attempt, size);
+
+		/*
+		 * Placement rarely fails below half load, so rule out copies of
+		 * a key before trying every other seed and size.
+		 */
+		uint64_t dup;
+		if (attempt == 0 && (dup = cuckooBuildFindDuplicate(work, n)) < n) {
+			fprintf(stderr, "Key %" PRIu64 " is a duplicate\n", dup);
+			goto error;
+		}
+	}
+	free(queue);
+	queue = NULL;
+
+	cuckooBuildRun(work, threads, size, cuckooBuildCheck);
+	for (i = 0; i < threads; i++) {
+		if (work[i].hasDuplicate) {
+			fprintf(stderr, "Key %" PRIu64 " is a duplicate\n", work[i].duplicate);
+			goto error;
+		}
+	}
+
+	t->table = cuckooArray(size, t->slotSize);
+	t->size = size;
+	t->count = n;
+	cuckooBuildRun(work, threads, size, cuckooBuildFill);
+
+	/*
+	 * Hand every thread's key arena over to the table.
+	 */
+	for (i = 0; i < threads; i++) {
+		CuckooArena *a = work[i].arena;
+		while (a != NULL) {
+			CuckooArena *next = a->next;
+			a->next = t->arena;
+			t->arena = a;
+			a = next;
+		}
+	}
+
+	free(work[0].slots);
+	free(work[0].hash);
+
+	return t;
+
+error:
+
+	free(queue);
+	free(work[0].slots);
+	free(work[0].hash);
+	free(t);
+	return NULL;
+}
+
+#ifdef CUCKOO_LATENCY
+static void
+cuckooRecordLatency(uint64_t *histogram, uint64_t start)
+{
+	uint64_t ns = cuckooNanos() - start;
+	int i = 63 - __builtin_clzll(ns | 1);
+	histogram[i < CUCKOO_LATENCY_BUCKETS ? i : CUCKOO_LATENCY_BUCKETS - 1]++;
+}
+
+#define LATENCY_START() uint64_t latencyStart = cuckooNanos()
+#define LATENCY_END(t, histogram) cuckooRecordLatency((t)->stats.histogram, latencyStart)
+#else
+#define LATENCY_START()
+#define LATENCY_END(t, histogram)
+#endif
+
+/*
+ * Find 'key' once its hashes are known.
+ */
+static CuckooElement *
+cuckooLookupHashed(CuckooTable *t, void *key, uint64_t len, uint64_t hash[2])
+{
+	CuckooElement *e = NULL;
+	uint64_t b[2];
+	int probes = 0;
+
+	cuckooMask(hash, t->size, b);
+
+	int i;
+	for (i = 0; i < 2; i++) {
+		e = cuckooSlot(t, t->table, b[i]);
+		probes++;
+		if (cuckooCompare(t, e, key, len, hash) == 0) {
+			/*
+			 * Found a match.
+			 */
+			goto found;
+		}
+	}
+
+	/*
+	 * While growing, elements that haven't been moved yet are still in
+	 * the old array.
+	 */
+	if (t->oldTable != NULL) {
+		cuckooMask(hash, t->oldSize, b);
+		for (i = 0; i < 2; i++) {
+			e = cuckooSlot(t, t->oldTable, b[i]);
+			probes++;
+			if (cuckooCompare(t, e, key, len, hash) == 0) {
+				goto found;
+			}
+		}
+	}
+
+	for (i = 0; i < t->stashCount; i++) {
+		e = cuckooStashSlot(t, i);
+		probes++;
+		if (cuckooCompare(t, e, key, len, hash) == 0) {
+			goto found;
+		}
+	}
+
+	t->stats.lookups++;
+	t->stats.probes[probes]++;
+	return NULL;
+
+found:
+
+	t->stats.lookups++;
+	t->stats.found++;
+	t->stats.probes[probes]++;
+	return e;
+}
+
+/*
+ * 0 success
+ * 1 would have resized
+ * -1 the table is mapped read-only
+ */
+int
+cuckooInsert(CuckooTable *t, void *key, uint64_t len, void *data)
+{
+	if (t->base != NULL) {
+		fprintf(stderr, "Can't insert into a mapped table\n");
+		return -1;
+	}
+
+	LATENCY_START();
+	cuckooMigrate(t, MIGRATE_STEP);
+
+	CuckooInlineElement n;
+	uint64_t hash[2];
+
+	t->hashFunc(key, len, t->seed, hash);
+
+	/*
+	 * See if it's already in the table.
+	 */
+	if (cuckooLookupHashed(t, key, len, hash) != NULL) {
+		LATENCY_END(t, insertLatency);
+		return 0;
+	}
+
+	cuckooMakeElement(t, &t->arena, &n, key, len, data, hash);
+
+	while (cuckooPlace(t, &n.e, hash) != 0) {
+		/*
+		 * Moving elements over can double the table once more, so stop
+		 * while the stored hashes still cover both.
+		 */
+		if (t->inlineKeys && t->size * 4 > CUCKOO_INLINE_MAX_SLOTS) {
+			fprintf(stderr, "Can't grow an inline key table past %" PRIu64 " slots\n", t->size);
+			LATENCY_END(t, insertLatency);
+			return -1;
+		}
+		uint64_t start = cuckooNanos();
+		cuckooGrow(t);
+		t->stats.resizeNanos += cuckooNanos() - start;
+	}
+	t->count++;
+
+	LATENCY_END(t, insertLatency);
+	return 0;
+}
+
+CuckooElement *
+cuckooLookup(CuckooTable *t, void *key, uint64_t len)
+{
+	uint64_t hash[2];
+
+	LATENCY_START();
+	t->hashFunc(key, len, t->seed, hash);
+	CuckooElement *e = cuckooLookupHashed(t, key, len, hash);
+	LATENCY_END(t, lookupLatency);
+
+	return e;
+}
+
+uint64_t
+cuckooLookupBatch(CuckooTable *t, void **keys, uint64_t *lens, uint64_t n, CuckooElement **out)
+{
+	uint64_t hash[CUCKOO_BATCH][2], b[2];
+	uint64_t found = 0;
+	uint64_t i, j, m;
+
+	for (i = 0; i < n; i += CUCKOO_BATCH) {
+		m = n - i < CUCKOO_BATCH ? n - i : CUCKOO_BATCH;
+
+		/*
+		 * Start loading both buckets of every key before looking at
+		 * any of them, so the cache misses overlap.
+		 */
+		for (j = 0; j < m; j++) {
+			t->hashFunc(keys[i + j], lens[i + j], t->seed, hash[j]);
+			cuckooMask(hash[j], t->size, b);
+			__builtin_prefetch(cuckooSlot(t, t->table, b[0]));
+			__builtin_prefetch(cuckooSlot(t, t->table, b[1]));
+		}
+
+		/*
+		 * Keys that aren't inline are another miss away, so start
+		 * loading those too. By now the first buckets have likely
+		 * arrived.
+		 */
+		if (!t->inlineKeys) {
+			for (j = 0; j < m; j++) {
+				cuckooMask(hash[j], t->size, b);
+				__builtin_prefetch(cuckooKeyAt(t, cuckooSlot(t, t->table, b[0])));
+				__builtin_prefetch(cuckooKeyAt(t, cuckooSlot(t, t->table, b[1])));
+			}
+		}
+
+		for (j = 0; j < m; j++) {
+			out[i + j] = cuckooLookupHashed(t, keys[i + j], lens[i + j], hash[j]);
+			found += out[i + j] != NULL;
+		}
+	}
+
+	return found;
+}
+
+void *
+cuckooDelete(CuckooTable *t, void *key, uint64_t len, CuckooDeleteCallback deleteCallback)
+{
+	if (t->base != NULL) {
+		fprintf(stderr, "Can't delete from a mapped table\n");
+		return NULL;
+	}
+
+	LATENCY_START();
+	cuckooMigrate(t, MIGRATE_STEP);
+
+	uint64_t hash[2];
+	t->hashFunc(key, len, t->seed, hash);
+
+	CuckooElement *e = cuckooLookupHashed(t, key, len, hash);
+	void *data = e->data;
+	if (deleteCallback) {
+		deleteCallback(e);
+	}
+	t->count--;
+
+	if ((CuckooInlineElement *)e >= t->stash && (CuckooInlineElement *)e < t->stash + CUCKOO_STASH_SIZE) {
+		CuckooElement *last = cuckooStashSlot(t, --t->stashCount);
+		if (e != last) {
+			cuckooCopy(t, e, last);
+		}
+		LATENCY_END(t, deleteLatency);
+		return data;
+	}
+
+	cuckooStore(e, NULL, 0, NULL);
+	if (t->stashCount > 0) {
+		cuckooDrainStash(t);
+	}
+	LATENCY_END(t, deleteLatency);
+	return data;
+}
+
+void
+cuckooStats(CuckooTable *t, CuckooStats *stats)
+{
+	*stats = t->stats;
+	stats->count = t->count;
+	stats->size = t->size + t->oldSize;
+	stats->stashCount = t->stashCount;
+	stats->loadFactor = (double)t->count / (t->size + t->oldSize);
+}
+
+void
+cuckooResetStats(CuckooTable *t)
+{
+	memset(&t->stats, 0, sizeof(t->stats));
+}
+
+void *
+cuckooKey(CuckooTable *t, CuckooElement *e)
+{
+	return e->key == NULL ? NULL : cuckooKeyAt(t, e);
+}
+
+void *
+cuckooData(CuckooTable *t, CuckooElement *e)
+{
+	if (!t->mappedData || e->data == NULL) {
+		return e->data;
+	}
+	return t->base + (uintptr_t)e->data;
+}
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+#define ALIGN64(x) (((x) + 63) & ~(uint64_t)63)
+
+/*
+ * Fold 'len' bytes, a multiple of 8, into a running checksum.
+ */
+static uint64_t
+cuckooChecksum(uint64_t sum, const void *buf, uint64_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t i;
+
+	for (i = 0; i < len; i += 8) {
+		uint64_t word;
+		memcpy(&word, p + i, sizeof(word));
+		sum ^= word;
+		sum *= 0xff51afd7ed558ccdULL;
+		sum ^= sum >> 33;
+	}
+
+	return sum;
+}
+
+/*
+ * The table's slots in the order they're saved: the array, then the stash.
+ */
+static CuckooElement *
+cuckooSaveSlot(CuckooTable *t, uint64_t i)
+{
+	return i < t->size ? cuckooSlot(t, t->table, i) : cuckooStashSlot(t, i - t->size);
+}
+
+static int
+cuckooWrite(FILE *f, const void *buf, uint64_t len, uint64_t *sum)
+{
+	*sum = cuckooChecksum(*sum, buf, len);
+	return fwrite(buf, 1, len, f) == len ? 0 : -1;
+}
+
+/*
+ * Write 'len' bytes of arena, padded with zeros to 8 bytes.
+ */
+static int
+cuckooWriteArena(FILE *f, const void *buf, uint64_t len, uint64_t *sum)
+{
+	uint8_t pad[8] = {0};
+	uint64_t tail = len & 7;
+
+	if (cuckooWrite(f, buf, len - tail, sum) != 0) {
+		return -1;
+	}
+	if (tail > 0) {
+		memcpy(pad, (const uint8_t *)buf + len - tail, tail);
+		return cuckooWrite(f, pad, sizeof(pad), sum);
+	}
+	return 0;
+}
+
+int
+cuckooSave(CuckooTable *t, const char *path, CuckooValueLength valueLength)
+{
+	CuckooImageHeader h = {0};
+	CuckooInlineElement slot;
+	uint64_t sum = 0;
+	uint64_t i, n, arena;
+	char *tmp = NULL;
+	FILE *f = NULL;
+
+	if (t == NULL || path == NULL || t->base != NULL) {
+		fprintf(stderr, "%s(%p, %p): Invalid arguments?!\n", __func__, t, path);
+		return -1;
+	}
+
+	while (t->oldTable != NULL) {
+		cuckooMigrate(t, t->oldSize);
+	}
+
+	memcpy(h.magic, CUCKOO_IMAGE_MAGIC, sizeof(h.magic));
+	h.version = CUCKOO_IMAGE_VERSION;
+	h.headerSize = sizeof(h);
+	h.size = t->size;
+	h.slotSize = t->slotSize;
+	h.count = t->count;
+	h.seed = t->seed;
+	h.inlineKeys = t->inlineKeys;
+	h.stashCount = t->stashCount;
+	h.mappedData = valueLength != NULL;
+	h.slotsOffset = ALIGN64(sizeof(h));
+	h.stashOffset = h.slotsOffset + t->size * t->slotSize;
+	h.arenaOffset = h.stashOffset + t->stashCount * t->slotSize;
+	n = t->size + t->stashCount;
+
+	if (asprintf(&tmp, "%s.tmp", path) < 0) {
+		tmp = NULL;
+		fprintf(stderr, "Can't alloc path: %s\n", strerror(errno));
+		goto error;
+	}
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Can't open %s: %s\n", tmp, strerror(errno));
+		goto error;
+	}
+
+	/*
+	 * The header goes in last, once the checksum and size are known.
+	 */
+	if (fseek(f, h.slotsOffset, SEEK_SET) < 0) {
+		goto writeError;
+	}
+
+	/*
+	 * Write the slots with their keys and data swapped for the offsets
+	 * they'll have in the arena...
+	 */
+	arena = h.arenaOffset;
+	for (i = 0; i < n; i++) {
+		CuckooElement *e = cuckooSaveSlot(t, i);
+		uint64_t at = i < t->size ? h.slotsOffset : h.stashOffset - t->size * t->slotSize;
+
+		memcpy(&slot, e, t->slotSize);
+		if (e->key != NULL) {
+			if (t->inlineKeys && e->key == ((CuckooInlineElement *)e)->key) {
+				slot.e.key = (void *)(uintptr_t)(at + i * t->slotSize + offsetof(CuckooInlineElement, key));
+			} else {
+				slot.e.key = (void *)(uintptr_t)arena;
+				arena += ALIGN8(e->len);
+			}
+			if (valueLength && e->data != NULL) {
+				slot.e.data = (void *)(uintptr_t)arena;
+				arena += ALIGN8(valueLength(e));
+			}
+		}
+		if (cuckooWrite(f, &slot, t->slotSize, &sum) != 0) {
+			goto writeError;
+		}
+	}
+
+	/*
+	 * ...then fill the arena in the same order.
+	 */
+	for (i = 0; i < n; i++) {
+		CuckooElement *e = cuckooSaveSlot(t, i);
+
+		if (e->key == NULL) {
+			continue;
+		}
+		if (!(t->inlineKeys && e->key == ((CuckooInlineElement *)e)->key) &&
+		    cuckooWriteArena(f, e->key, e->len, &sum) != 0) {
+			goto writeError;
+		}
+		if (valueLength && e->data != NULL &&
+		    cuckooWriteArena(f, e->data, valueLength(e), &sum) != 0) {
+			goto writeError;
+		}
+	}
+
+	h.fileSize = arena;
+	h.checksum = sum;
+	if (fseek(f, 0, SEEK_SET) < 0 || fwrite(&h, sizeof(h), 1, f) != 1 ||
+	    fflush(f) != 0 || fsync(fileno(f)) < 0) {
+		goto writeError;
+	}
+	if (fclose(f) != 0) {
+		f = NULL;
+		goto writeError;
+	}
+	f = NULL;
+	if (rename(tmp, path) < 0) {
+		fprintf(stderr, "Can't rename %s to %s: %s\n", tmp, path, strerror(errno));
+		goto error;
+	}
+
+	free(tmp);
+
+	return 0;
+
+writeError:
+
+	fprintf(stderr, "Can't write %s: %s\n", tmp, strerror(errno));
+
+error:
+
+	if (f) {
+		fclose(f);
+	}
+	if (tmp) {
+		unlink(tmp);
+		free(tmp);
+	}
+	return -1;
+}
+
+CuckooTable *
+cuckooOpenMapped(const char *path, CuckooHashFunction hashFunc, int verify)
+{
+	CuckooTable *t;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "Can't stat %s: %s\n", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < sizeof(CuckooImageHeader)) {
+		fprintf(stderr, "%s is too small to be a table image\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Can't mmap %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	/*
+	 * Check the header describes a file of exactly this size with every
+	 * section inside it, then the checksum if asked to.
+	 */
+	const CuckooImageHeader *h = (const CuckooImageHeader *)map;
+	uint64_t slotSize = h->inlineKeys ? sizeof(CuckooInlineElement) : sizeof(CuckooElement);
+	const char *why = NULL;
+	if (memcmp(h->magic, CUCKOO_IMAGE_MAGIC, sizeof(h->magic)) != 0) {
+		why = "bad magic";
+	} else if (h->version != CUCKOO_IMAGE_VERSION) {
+		why = "unsupported version";
+	} else if (h->headerSize != sizeof(*h) || h->fileSize != st.st_size || h->slotSize != slotSize) {
+		why = "bad size";
+	} else if (h->size < 4 || (h->size & (h->size - 1)) != 0 ||
+		(h->inlineKeys && h->size > CUCKOO_INLINE_MAX_SLOTS) ||
+		h->stashCount > CUCKOO_STASH_SIZE || h->slotsOffset % 64 ||
+		h->slotsOffset < sizeof(*h) || h->slotsOffset > h->fileSize ||
+		h->size > (h->fileSize - h->slotsOffset) / slotSize ||
+		h->stashOffset != h->slotsOffset + h->size * slotSize ||
+		h->arenaOffset != h->stashOffset + h->stashCount * slotSize ||
+		h->arenaOffset > h->fileSize) {
+		why = "bad section offsets";
+	} else if (verify && h->checksum != cuckooChecksum(0, map + h->slotsOffset, h->fileSize - h->slotsOffset)) {
+		why = "bad checksum";
+	}
+	if (why) {
+		fprintf(stderr, "Can't use %s: %s\n", path, why);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		fprintf(stderr, "Can't alloc mapped table: %s\n", strerror(errno));
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	/*
+	 * Lookups land on random slots, so reading ahead only wastes memory.
+	 */
+	madvise(map + h->slotsOffset, h->size * slotSize, MADV_RANDOM);
+
+	t->table = (CuckooElement *)(map + h->slotsOffset);
+	t->size = h->size;
+	t->slotSize = slotSize;
+	t->inlineKeys = h->inlineKeys;
+	t->count = h->count;
+	t->seed = h->seed;
+	t->hashFunc = hashFunc ? hashFunc : cuckooFastHash;
+	t->base = map;
+	t->mapSize = st.st_size;
+	t->mappedData = h->mappedData;
+
+	/*
+	 * The stash is copied out, but its keys still point into the file.
+	 */
+	int i;
+	for (i = 0; i < h->stashCount; i++) {
+		memcpy(cuckooStashSlot(t, i), map + h->stashOffset + i * slotSize, slotSize);
+	}
+	t->stashCount = h->stashCount;
+
+	return t;
+}
+
+void
 cuckooFree(CuckooTable **t)
 {
 	if (t == NULL) {
 		return;
 	}
 
+	if ((*t)->base != NULL) {
+		munmap((*t)->base, (*t)->mapSize);
+		free(*t);
+		*t = NULL;
+		return;
+	}
+
 	int i;
 	for (i = 0; i < (*t)->size; i++) {
-		CuckooElement *e = (*t)->table + i;
+		CuckooElement *e = cuckooSlot(*t, (*t)->table, i);
 		if ((*t)->deleteCallback) {
 			(*t)->deleteCallback(e);
 		}
 		cuckooStore(e, NULL, 0, NULL);
 	}
+	for (i = 0; i < (*t)->oldSize; i++) {
+		CuckooElement *e = cuckooSlot(*t, (*t)->oldTable, i);
+		if ((*t)->deleteCallback) {
+			(*t)->deleteCallback(e);
+		}
+	}
+	for (i = 0; i < (*t)->stashCount; i++) {
+		if ((*t)->deleteCallback) {
+			(*t)->deleteCallback(cuckooStashSlot(*t, i));
+		}
+	}
 
-	free((*t)->table);
+	while ((*t)->arena != NULL) {
+		CuckooArena *next = (*t)->arena->next;
+		free((*t)->arena);
+		(*t)->arena = next;
+	}
+	cuckooArrayFree(*t, (*t)->table);
+	cuckooArrayFree(*t, (*t)->oldTable);
 	free(*t);
 	*t = NULL;
 }
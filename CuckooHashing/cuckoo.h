@@ -3,6 +3,8 @@
 
 #include <inttypes.h>
 
+#include "hash.h"
+
 typedef struct CuckooElement {
 	void *key;
 	uint64_t len;
@@ -11,22 +13,313 @@ typedef struct CuckooElement {
 
 typedef int (*CuckooDeleteCallback)(CuckooElement *e);
 
+/*
+ * How many bytes of value 'e->data' points at, for cuckooSave().
+ */
+typedef uint64_t (*CuckooValueLength)(CuckooElement *e);
+
+/*
+ * Keys of up to this many bytes are stored in the slot itself by tables
+ * with inline keys.
+ */
+#define CUCKOO_INLINE_KEY 32
+
+/*
+ * Tables with inline keys only keep 32 bits of each of a key's hashes, so
+ * they can't have more slots than this.
+ */
+#define CUCKOO_INLINE_MAX_SLOTS (1ULL << 32)
+
+/*
+ * The slot layout of tables with inline keys. 'e.key' points at 'key' for
+ * short keys and into the table's key arena for longer ones, so the table
+ * never reads the caller's copy of a key after inserting it. 'hash' keeps
+ * the key's hashes, so growing the table or kicking an element out never
+ * has to hash its key again, and a lookup only compares keys whose hash
+ * matches. A slot is exactly one cache line.
+ */
+typedef struct CuckooInlineElement {
+	CuckooElement e;
+	uint64_t hash;
+	uint8_t key[CUCKOO_INLINE_KEY];
+} CuckooInlineElement;
+
+/*
+ * Elements that couldn't be placed go here until the table grows or a slot
+ * frees up. Every lookup that misses the table scans it, so it's small.
+ */
+#define CUCKOO_STASH_SIZE 4
+
+/*
+ * How many keys cuckooLookupBatch has in flight at once. Enough to keep the
+ * memory system busy; its hashes still fit on the stack.
+ */
+#define CUCKOO_BATCH 32
+
+/*
+ * Slots a lookup can compare: two in the current array, two in the old one
+ * while growing, then the stash.
+ */
+#define CUCKOO_MAX_PROBES (4 + CUCKOO_STASH_SIZE)
+
+#define CUCKOO_KICK_BUCKETS 16
+
+/*
+ * Per-operation latencies are only recorded when built with
+ * -DCUCKOO_LATENCY. Bucket i counts operations that took from 2^i up to
+ * 2^(i+1) nanoseconds.
+ */
+#define CUCKOO_LATENCY_BUCKETS 32
+
+typedef struct CuckooStats {
+	/*
+	 * Filled in by cuckooStats(). The load factor counts the stash and
+	 * an old array that's still being emptied as part of the table.
+	 */
+	uint64_t count;
+	uint64_t size;
+	int stashCount;
+	double loadFactor;
+
+	/*
+	 * Every time an element is placed, whether inserted or moved while
+	 * growing, the number of elements kicked along to make room for it.
+	 * The last bucket counts that many or more. Elements that had no
+	 * path to a free slot and went in the stash are counted in 'stashed'
+	 * instead.
+	 */
+	uint64_t kicks[CUCKOO_KICK_BUCKETS];
+	uint64_t stashed;
+
+	/*
+	 * 'grows' counts incremental growths started and 'rebuilds' the
+	 * blocking fallbacks. 'resizeNanos' is the time inserts spent
+	 * starting either, but not moving elements over a few at a time.
+	 */
+	uint64_t grows;
+	uint64_t rebuilds;
+	uint64_t resizeNanos;
+
+	/*
+	 * Lookups, including the ones inserts and deletes do, by the number
+	 * of slots they compared.
+	 */
+	uint64_t lookups;
+	uint64_t found;
+	uint64_t probes[CUCKOO_MAX_PROBES + 1];
+
+#ifdef CUCKOO_LATENCY
+	uint64_t insertLatency[CUCKOO_LATENCY_BUCKETS];
+	uint64_t lookupLatency[CUCKOO_LATENCY_BUCKETS];
+	uint64_t deleteLatency[CUCKOO_LATENCY_BUCKETS];
+#endif
+} CuckooStats;
+
 typedef struct CuckooTable {
+	/*
+	 * 'slotSize' bytes per slot: a CuckooElement, or a CuckooInlineElement
+	 * with inline keys.
+	 */
 	struct CuckooElement *table;
 	uint64_t size;
+	uint64_t slotSize;
+	int inlineKeys;
+	struct CuckooArena *arena;
+
+	CuckooInlineElement stash[CUCKOO_STASH_SIZE];
+	int stashCount;
+
+	/*
+	 * While the table is growing, the array it's growing out of. Slots
+	 * below 'migrated' have already been moved to 'table'.
+	 */
+	struct CuckooElement *oldTable;
+	uint64_t oldSize;
+	uint64_t migrated;
+
+	uint64_t count;
+	CuckooHashFunction hashFunc;
+	uint64_t seed;
 	CuckooDeleteCallback deleteCallback;
+
+	/*
+	 * The mapping of a table opened with cuckooOpenMapped(), or NULL.
+	 * Element keys, and data if 'mappedData' is set, are then offsets
+	 * from 'base'.
+	 */
+	uint8_t *base;
+	uint64_t mapSize;
+	int mappedData;
+
+	CuckooStats stats;
 } CuckooTable;
 
+/*
+ * On-disk image of a CuckooTable that is served straight from an mmap()ed
+ * file. Fields are in host byte order:
+ *
+ *   CuckooImageHeader
+ *   slots[size]          64-byte aligned, 'slotSize' bytes each
+ *   stash[stashCount]
+ *   arena                keys that weren't inline, then saved values
+ *
+ * Slots are saved as they are in memory, except their key and data
+ * pointers, which become offsets from the start of the file. Arena entries
+ * are padded to 8 bytes.
+ */
+#define CUCKOO_IMAGE_MAGIC "CUCKOOT"
+#define CUCKOO_IMAGE_VERSION 1
+
+typedef struct CuckooImageHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize;
+	uint64_t fileSize;
+
+	uint64_t size;
+	uint64_t slotSize;
+	uint64_t count;
+	uint64_t seed;
+	uint32_t inlineKeys;
+	uint32_t stashCount;
+
+	/*
+	 * Whether data fields are offsets of saved values or the saved
+	 * data pointers themselves.
+	 */
+	uint32_t mappedData;
+	uint32_t unused;
+
+	uint64_t slotsOffset;
+	uint64_t stashOffset;
+	uint64_t arenaOffset;
+
+	/*
+	 * Checksum of everything after the header.
+	 */
+	uint64_t checksum;
+} CuckooImageHeader;
+
+/*
+ * The size is rounded up to a power of two so buckets can be picked with a
+ * mask. The table hashes with cuckooFastHash() unless cuckooSetHash() says
+ * otherwise.
+ */
 CuckooTable *cuckooAlloc(uint64_t initialSize, CuckooDeleteCallback deleteCallback);
 
+/*
+ * Only allowed while the table is empty.
+ *
+ * 0 success
+ * -1 the table isn't empty
+ */
+int cuckooSetHash(CuckooTable *t, CuckooHashFunction hashFunc, uint64_t seed);
+
+/*
+ * Make the table keep its own copy of every key, inline in the slot when
+ * it's at most CUCKOO_INLINE_KEY bytes, and the key's hashes next to it.
+ * The caller's keys can be freed as soon as they're inserted, and element
+ * keys must not be freed by a CuckooDeleteCallback. Deleted keys' arena
+ * space is only reclaimed when the table is freed. Tables with inline keys
+ * hold at most CUCKOO_INLINE_MAX_SLOTS slots.
+ *
+ * Only allowed while the table is empty.
+ *
+ * 0 success
+ * -1 the table isn't empty, or is too big
+ */
+int cuckooSetInlineKeys(CuckooTable *t);
+
+/*
+ * Build a table of 'n' distinct keys in one go, for data that's loaded once
+ * and then mostly read. Where every key goes is worked out from the keys'
+ * hashes before the table is allocated, so nothing is ever kicked out or
+ * resized, and the slots are then filled by as many threads as there are
+ * CPUs. 'values' may be NULL.
+ *
+ * The table is allocated once, with the fewest slots that keep it under
+ * 'targetLoad', which must be below 0.5; a one slot per bucket table can't
+ * hold more. The closer to 0.5, the likelier it takes a few tries with
+ * other seeds, and maybe a bigger table, to find a placement.
+ *
+ * The result is an ordinary table that can be changed afterwards. Keys are
+ * only referenced, as with cuckooInsert(), unless 'inlineKeys' is set,
+ * which works as cuckooSetInlineKeys() does.
+ *
+ * On success, a pointer to the new table is returned.
+ * On error, including a key that's in 'keys' more than once, NULL is
+ * returned.
+ */
+CuckooTable *cuckooBuild(void **keys, uint64_t *lens, void **values, uint64_t n, double targetLoad,
+                         int inlineKeys);
+
 /*
  * 0 success
  * 1 would have resized
+ * -1 the table is mapped read-only, or has inline keys and would have to
+ *    grow past CUCKOO_INLINE_MAX_SLOTS
  */
 int cuckooInsert(CuckooTable *t, void *key, uint64_t len, void *data);
 
 CuckooElement *cuckooLookup(CuckooTable *t, void *key, uint64_t len);
+
+/*
+ * Look up 'n' keys at once, setting 'out[i]' to what cuckooLookup would
+ * return for 'keys[i]'. Groups of CUCKOO_BATCH keys are hashed and all their
+ * buckets prefetched before any are compared, which hides most of the
+ * memory latency on tables much bigger than the cache.
+ *
+ * Returns how many keys were found.
+ */
+uint64_t cuckooLookupBatch(CuckooTable *t, void **keys, uint64_t *lens, uint64_t n, CuckooElement **out);
+
 void *cuckooDelete(CuckooTable *t, void *key, uint64_t len, CuckooDeleteCallback deleteCallback);
+
+/*
+ * Copy out the table's statistics, which are kept since it was allocated
+ * or last reset. Keeping them costs a few increments per operation.
+ */
+void cuckooStats(CuckooTable *t, CuckooStats *stats);
+void cuckooResetStats(CuckooTable *t);
+
+/*
+ * An element's key and data. Elements of mapped tables hold offsets, so
+ * use these rather than 'e->key' and 'e->data' for them.
+ */
+void *cuckooKey(CuckooTable *t, CuckooElement *e);
+void *cuckooData(CuckooTable *t, CuckooElement *e);
+
+/*
+ * Write the table to 'path', finishing any growth in progress first. The
+ * file is written next to 'path' and renamed into place, so readers never
+ * see a partial image.
+ *
+ * If 'valueLength' is NULL, data pointers are saved as they are, which
+ * suits tables whose data are small integers. Otherwise the bytes every
+ * element's data points at are saved too.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned.
+ */
+int cuckooSave(CuckooTable *t, const char *path, CuckooValueLength valueLength);
+
+/*
+ * Map the image at 'path' read-only and return it as a table that
+ * cuckooLookup() and cuckooLookupBatch() search in place. Nothing is copied
+ * or rebuilt, so opening costs a few page faults whatever the table's size,
+ * and each lookup faults in at most the pages it touches. Inserts and
+ * deletes fail. 'hashFunc' must be the hash of the saved table, or NULL for
+ * cuckooFastHash().
+ *
+ * The header is always checked. If 'verify' is set, the checksum is too,
+ * which reads the whole file; without it, a corrupt image can crash
+ * lookups.
+ *
+ * On success, a pointer to the table is returned; cuckooFree() unmaps it.
+ * On error, NULL is returned.
+ */
+CuckooTable *cuckooOpenMapped(const char *path, CuckooHashFunction hashFunc, int verify);
+
 void cuckooFree(CuckooTable **t);
 
 #endif /* __CUCKOO_H */
@@ -0,0 +1,247 @@
+#include "filter.h"
+#include "hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#ifdef DEBUG
+#define debug(...) printf(__VA_ARGS__)
+#else
+#define debug(...)
+#endif
+
+/*
+ * Slot 'i' of bucket 'b' holds fpBits bits starting at bit
+ * (b * FILTER_WAYS + i) * fpBits. With at most 16 bit fingerprints, a slot
+ * always fits in the 4 bytes starting at its first byte.
+ */
+static inline uint16_t
+slotGet(CuckooFilter *f, uint64_t b, int i)
+{
+	uint64_t bit = (b * FILTER_WAYS + i) * f->fpBits;
+	uint32_t word;
+
+	memcpy(&word, f->slots + bit / 8, sizeof(word));
+	return (word >> (bit % 8)) & ((1u << f->fpBits) - 1);
+}
+
+static inline void
+slotSet(CuckooFilter *f, uint64_t b, int i, uint16_t fp)
+{
+	uint64_t bit = (b * FILTER_WAYS + i) * f->fpBits;
+	uint32_t mask = ((1u << f->fpBits) - 1) << (bit % 8);
+	uint32_t word;
+
+	memcpy(&word, f->slots + bit / 8, sizeof(word));
+	word = (word & ~mask) | ((uint32_t)fp << (bit % 8));
+	memcpy(f->slots + bit / 8, &word, sizeof(word));
+}
+
+/*
+ * The bucket comes from one of the key's hashes and the fingerprint from
+ * the other. 0 marks an empty slot, so it's never a fingerprint.
+ */
+static inline void
+filterHash(CuckooFilter *f, void *key, uint64_t len, uint64_t *b, uint16_t *fp)
+{
+	uint64_t hash[2];
+
+	cuckooFastHash(key, len, f->seed, hash);
+	*b = hash[0] & (f->numBuckets - 1);
+	*fp = hash[1] & ((1u << f->fpBits) - 1);
+	if (*fp == 0) {
+		*fp = 1;
+	}
+}
+
+static inline uint64_t
+altBucket(CuckooFilter *f, uint64_t b, uint16_t fp)
+{
+	return cuckooAltBucket(b, fp, f->numBuckets);
+}
+
+static inline int
+bucketFind(CuckooFilter *f, uint64_t b, uint16_t fp)
+{
+	int i;
+	for (i = 0; i < FILTER_WAYS; i++) {
+		if (slotGet(f, b, i) == fp) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+CuckooFilter *
+filterAlloc(uint64_t capacity, int fpBits)
+{
+	CuckooFilter *f;
+	uint64_t numBuckets = 1;
+
+	if (fpBits < 4 || fpBits > 16) {
+		fprintf(stderr, "%s(%" PRIu64 ", %d): Invalid arguments?!\n", __func__, capacity, fpBits);
+		return NULL;
+	}
+
+	while (numBuckets * FILTER_WAYS * 95 / 100 < capacity) {
+		numBuckets *= 2;
+	}
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL) {
+		return NULL;
+	}
+
+	/*
+	 * Padded so the last slot can be read with a 4 byte load.
+	 */
+	f->slots = calloc((numBuckets * FILTER_WAYS * fpBits + 7) / 8 + sizeof(uint32_t), 1);
+	if (f->slots == NULL) {
+		free(f);
+		return NULL;
+	}
+	f->numBuckets = numBuckets;
+	f->fpBits = fpBits;
+	f->seed = 0xf117e5;
+	f->rng = 0x9e3779b97f4a7c15ULL;
+
+	return f;
+}
+
+int
+filterInsert(CuckooFilter *f, void *key, uint64_t len)
+{
+	uint64_t b;
+	uint16_t fp;
+
+	if (f->hasVictim) {
+		debug("The filter is full\n");
+		return 1;
+	}
+
+	filterHash(f, key, len, &b, &fp);
+
+	int i, kicks;
+	for (kicks = 0; kicks < CUCKOO_MAX_KICKS; kicks++) {
+		if ((i = bucketFind(f, b, 0)) >= 0) {
+			slotSet(f, b, i, fp);
+			f->count++;
+			return 0;
+		}
+		if (kicks == 0 && (i = bucketFind(f, altBucket(f, b, fp), 0)) >= 0) {
+			slotSet(f, altBucket(f, b, fp), i, fp);
+			f->count++;
+			return 0;
+		}
+
+		/*
+		 * Both buckets are full. Swap with a random fingerprint in one
+		 * of them and carry it over to its other bucket.
+		 */
+		f->rng ^= f->rng << 13;
+		f->rng ^= f->rng >> 7;
+		f->rng ^= f->rng << 17;
+		if (kicks == 0 && (f->rng & 0x100)) {
+			b = altBucket(f, b, fp);
+		}
+
+		i = f->rng % FILTER_WAYS;
+		uint16_t victim = slotGet(f, b, i);
+		slotSet(f, b, i, fp);
+		fp = victim;
+		b = altBucket(f, b, fp);
+	}
+
+	debug("Gave up after %d kicks\n", kicks);
+	f->hasVictim = 1;
+	f->victimFp = fp;
+	f->victimBucket = b;
+	f->count++;
+
+	return 0;
+}
+
+int
+filterContains(CuckooFilter *f, void *key, uint64_t len)
+{
+	uint64_t b;
+	uint16_t fp;
+
+	filterHash(f, key, len, &b, &fp);
+
+	uint64_t alt = altBucket(f, b, fp);
+	if (bucketFind(f, b, fp) >= 0 || bucketFind(f, alt, fp) >= 0) {
+		return 1;
+	}
+
+	return f->hasVictim && f->victimFp == fp &&
+	       (f->victimBucket == b || f->victimBucket == alt);
+}
+
+int
+filterDelete(CuckooFilter *f, void *key, uint64_t len)
+{
+	uint64_t b, alt;
+	uint16_t fp;
+	int i;
+
+	filterHash(f, key, len, &b, &fp);
+	alt = altBucket(f, b, fp);
+
+	if ((i = bucketFind(f, b, fp)) >= 0) {
+		slotSet(f, b, i, 0);
+	} else if ((i = bucketFind(f, alt, fp)) >= 0) {
+		slotSet(f, alt, i, 0);
+	} else if (f->hasVictim && f->victimFp == fp &&
+	           (f->victimBucket == b || f->victimBucket == alt)) {
+		f->hasVictim = 0;
+		f->count--;
+		return 0;
+	} else {
+		return 1;
+	}
+	f->count--;
+
+	/*
+	 * There's a free slot now, which may be where the victim goes.
+	 */
+	if (f->hasVictim) {
+		uint64_t vb = f->victimBucket;
+		uint64_t valt = altBucket(f, vb, f->victimFp);
+		if ((i = bucketFind(f, vb, 0)) >= 0) {
+			slotSet(f, vb, i, f->victimFp);
+			f->hasVictim = 0;
+		} else if ((i = bucketFind(f, valt, 0)) >= 0) {
+			slotSet(f, valt, i, f->victimFp);
+			f->hasVictim = 0;
+		}
+	}
+
+	return 0;
+}
+
+double
+filterLoadFactor(CuckooFilter *f)
+{
+	return (double)f->count / (f->numBuckets * FILTER_WAYS);
+}
+
+double
+filterBitsPerEntry(CuckooFilter *f)
+{
+	return (double)f->numBuckets * FILTER_WAYS * f->fpBits / f->count;
+}
+
+void
+filterFree(CuckooFilter **f)
+{
+	if (f == NULL || *f == NULL) {
+		return;
+	}
+
+	free((*f)->slots);
+	free(*f);
+	*f = NULL;
+}
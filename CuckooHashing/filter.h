@@ -0,0 +1,83 @@
+#ifndef __FILTER_H
+#define __FILTER_H
+
+#include <inttypes.h>
+
+/*
+ * A cuckoo filter: a set membership test like a Bloom filter that also
+ * supports deletes, and takes fewer bits per entry once false positives
+ * have to be rarer than about 1 in 200.
+ *
+ * Only a small fingerprint of each key is kept, in one of two buckets of
+ * FILTER_WAYS slots. The second bucket is the first one xor a hash of the
+ * fingerprint, so a fingerprint can be kicked to its other bucket without
+ * knowing the key it came from (partial-key cuckoo hashing). Fingerprints
+ * are bit packed, so a filter with 12 bit fingerprints really uses 12 bits
+ * per slot.
+ *
+ * A lookup is wrong with probability about 2 * FILTER_WAYS / 2^fpBits, and
+ * only ever in the "maybe" direction.
+ */
+
+#define FILTER_WAYS 4
+
+typedef struct CuckooFilter {
+	uint8_t *slots;
+	uint64_t numBuckets;
+	int fpBits;
+	uint64_t count;
+	uint64_t seed;
+	uint64_t rng;
+
+	/*
+	 * A fingerprint that couldn't be placed. Once it's taken the filter
+	 * is full.
+	 */
+	int hasVictim;
+	uint16_t victimFp;
+	uint64_t victimBucket;
+} CuckooFilter;
+
+/*
+ * Size the filter to hold 'capacity' keys at about 95% load, with
+ * fingerprints of 'fpBits' bits (4 to 16).
+ *
+ * On success, a pointer to the new filter is returned.
+ * On error, NULL is returned.
+ */
+CuckooFilter *filterAlloc(uint64_t capacity, int fpBits);
+
+/*
+ * Inserting the same key twice stores two fingerprints, which both have
+ * to be deleted.
+ *
+ * 0 success
+ * 1 the filter is full
+ */
+int filterInsert(CuckooFilter *f, void *key, uint64_t len);
+
+/*
+ * 1 the key may have been inserted
+ * 0 the key definitely wasn't inserted
+ */
+int filterContains(CuckooFilter *f, void *key, uint64_t len);
+
+/*
+ * Only delete keys that were inserted, or another key's fingerprint might
+ * be removed instead.
+ *
+ * 0 success
+ * 1 not found
+ */
+int filterDelete(CuckooFilter *f, void *key, uint64_t len);
+
+double filterLoadFactor(CuckooFilter *f);
+
+/*
+ * The filter's size in bits divided by the number of keys in it.
+ */
+double filterBitsPerEntry(CuckooFilter *f);
+
+void filterFree(CuckooFilter **f);
+
+#endif /* __FILTER_H */
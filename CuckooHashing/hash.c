@@ -0,0 +1,142 @@
+#include <string.h>
+
+#include "hash.h"
+
+static const uint64_t wySecret[4] = {
+	0x2d358dccaa6c78a5ULL,
+	0x8bb84b93962eacc9ULL,
+	0x4b33a62ed433d4a3ULL,
+	0x4d5a2da51de1aa47ULL
+};
+
+static inline void
+wyMum(uint64_t *a, uint64_t *b)
+{
+	__uint128_t r = (__uint128_t)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t
+wyMix(uint64_t a, uint64_t b)
+{
+	wyMum(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t
+wyRead8(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+wyRead4(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+wyRead3(const uint8_t *p, uint64_t k)
+{
+	return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+void
+cuckooFastHash(void *key, uint64_t len, uint64_t seed, uint64_t hash[2])
+{
+	const uint8_t *p = key;
+	uint64_t a, b;
+
+	seed ^= wyMix(seed ^ wySecret[0], wySecret[1]);
+
+	if (len <= 16) {
+		if (len >= 4) {
+			a = (wyRead4(p) << 32) | wyRead4(p + ((len >> 3) << 2));
+			b = (wyRead4(p + len - 4) << 32) | wyRead4(p + len - 4 - ((len >> 3) << 2));
+		} else if (len > 0) {
+			a = wyRead3(p, len);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		uint64_t i = len;
+		if (i >= 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = wyMix(wyRead8(p) ^ wySecret[1], wyRead8(p + 8) ^ seed);
+				see1 = wyMix(wyRead8(p + 16) ^ wySecret[2], wyRead8(p + 24) ^ see1);
+				see2 = wyMix(wyRead8(p + 32) ^ wySecret[3], wyRead8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i >= 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = wyMix(wyRead8(p) ^ wySecret[1], wyRead8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = wyRead8(p + i - 16);
+		b = wyRead8(p + i - 8);
+	}
+
+	a ^= wySecret[1];
+	b ^= seed;
+	wyMum(&a, &b);
+
+	/*
+	 * The first output is plain wyhash. The second multiplies the same
+	 * state by different secrets.
+	 */
+	hash[0] = wyMix(a ^ wySecret[0] ^ len, b ^ wySecret[1]);
+	hash[1] = wyMix(a ^ wySecret[2] ^ len, b ^ wySecret[3]);
+}
+
+static uint64_t
+polyHash(void *key, uint64_t len, uint64_t p, uint64_t M)
+{
+	uint64_t hash = 0;
+	int i;
+	for (i = len-1; i >=0; i--) {
+		hash = (hash * p + ((uint8_t *)key)[i]) % M;
+	}
+	return hash;
+}
+
+#define PRIME1 3851
+#define PRIME2 7477
+
+/*
+ * The largest prime below 2^32, so the products above never overflow.
+ */
+#define POLY_MODULUS 4294967291ULL
+
+void
+cuckooPolyHash(void *key, uint64_t len, uint64_t seed, uint64_t hash[2])
+{
+	hash[0] = polyHash(key, len, PRIME1, POLY_MODULUS) ^ seed;
+	hash[1] = polyHash(key, len, PRIME2, POLY_MODULUS) ^ seed;
+}
+
+uint64_t
+cuckooMix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+uint64_t
+cuckooAltBucket(uint64_t b, uint64_t tag, uint64_t numBuckets)
+{
+	return (b ^ (cuckooMix(tag) | 1)) & (numBuckets - 1);
+}
@@ -0,0 +1,47 @@
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <inttypes.h>
+
+/*
+ * Hash 'key' into two 64-bit values, one for each of a key's two cuckoo
+ * buckets. Tables are a power of two in size and use the low bits of each.
+ */
+typedef void (*CuckooHashFunction)(void *key, uint64_t len, uint64_t seed, uint64_t hash[2]);
+
+/*
+ * Seeded wyhash (final version 4) that reads the key 8 or 16 bytes at a time
+ * and finishes the same state two ways, so both outputs cost one pass. This
+ * is the default.
+ */
+void cuckooFastHash(void *key, uint64_t len, uint64_t seed, uint64_t hash[2]);
+
+/*
+ * The original polynomial hashes, one per output. Both take a 64-bit modulo
+ * per key byte, so they're only kept around to compare against.
+ */
+void cuckooPolyHash(void *key, uint64_t len, uint64_t seed, uint64_t hash[2]);
+
+/*
+ * MurmurHash3's 64-bit finalizer, for spreading short values such as
+ * fingerprints over all 64 bits.
+ */
+uint64_t cuckooMix(uint64_t h);
+
+/*
+ * The other of an element's two buckets, in a table of 'numBuckets' (a power
+ * of two), from the bucket 'b' it's in and a 'tag' kept with it such as its
+ * fingerprint. Applying it twice gets back to 'b', so an element can be
+ * kicked to its other bucket without rehashing, or even reading, its key.
+ * The xor mask is odd, so the two buckets differ whenever there's more than
+ * one.
+ */
+uint64_t cuckooAltBucket(uint64_t b, uint64_t tag, uint64_t numBuckets);
+
+/*
+ * How many elements a random walk may kick out placing one element before
+ * it gives up.
+ */
+#define CUCKOO_MAX_KICKS 500
+
+#endif /* __HASH_H */
@@ -0,0 +1,604 @@
+#include "shared.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#ifdef DEBUG
+#define debug(...) printf(__VA_ARGS__)
+#else
+#define debug(...)
+#endif
+
+/*
+ * How many buckets an insert may search for an eviction path before it
+ * grows the table, and how many times in a row it may lose a race while
+ * moving elements along one.
+ */
+#define MAX_SEARCH 256
+#define MAX_ATTEMPTS 8
+
+#define relaxed memory_order_relaxed
+
+static inline void
+cpuRelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline uint64_t
+keyHash(SharedTable *t, void *key, uint64_t len)
+{
+	uint64_t hash[2];
+	cuckooFastHash(key, len, t->seed, hash);
+	return hash[0] ? hash[0] : 1;
+}
+
+/*
+ * A key's buckets are the low bits of its hash and their other bucket, with
+ * the high half of the hash as the tag. Both array sizes and the stripe
+ * count are powers of two, so a key's stripes don't change when the table
+ * grows.
+ */
+static inline uint64_t
+otherBucket(SharedArray *a, uint64_t b, uint64_t hash)
+{
+	return cuckooAltBucket(b, hash >> 32, a->numBuckets);
+}
+
+static inline uint64_t
+stripeOf(uint64_t b)
+{
+	return b & (SHARED_STRIPES - 1);
+}
+
+static void
+stripeLock(SharedTable *t, uint64_t s)
+{
+	atomic_uint_fast64_t *version = &t->stripes[s].version;
+
+	for (;;) {
+		uint_fast64_t v = atomic_load_explicit(version, relaxed);
+		if ((v & 1) == 0 &&
+		    atomic_compare_exchange_weak_explicit(version, &v, v + 1,
+		                                          memory_order_acquire, relaxed)) {
+			break;
+		}
+		cpuRelax();
+	}
+
+	/*
+	 * Readers must see the odd version before any of the writes that
+	 * follow.
+	 */
+	atomic_thread_fence(memory_order_release);
+}
+
+static void
+stripeUnlock(SharedTable *t, uint64_t s)
+{
+	atomic_fetch_add_explicit(&t->stripes[s].version, 1, memory_order_release);
+}
+
+/*
+ * Stripes are always locked in increasing order so writers can't deadlock.
+ */
+static void
+lockPair(SharedTable *t, uint64_t s0, uint64_t s1)
+{
+	if (s0 > s1) {
+		uint64_t tmp = s0;
+		s0 = s1;
+		s1 = tmp;
+	}
+	stripeLock(t, s0);
+	if (s1 != s0) {
+		stripeLock(t, s1);
+	}
+}
+
+static void
+unlockPair(SharedTable *t, uint64_t s0, uint64_t s1)
+{
+	stripeUnlock(t, s0);
+	if (s1 != s0) {
+		stripeUnlock(t, s1);
+	}
+}
+
+/*
+ * Lock a pair of stripes to write to the array, after any resize.
+ *
+ * A writer that locks a stripe and then doesn't see the resizing flag has
+ * the stripe odd before the resize looks at it, so the resize waits for it.
+ */
+static void
+writeLock(SharedTable *t, uint64_t s0, uint64_t s1)
+{
+	for (;;) {
+		lockPair(t, s0, s1);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		/*
+		 * Acquire, so a writer that comes after a resize sees all of the
+		 * new array.
+		 */
+		if (!atomic_load_explicit(&t->resizing, memory_order_acquire)) {
+			return;
+		}
+		unlockPair(t, s0, s1);
+
+		while (atomic_load_explicit(&t->resizing, relaxed)) {
+			cpuRelax();
+		}
+	}
+}
+
+static inline void
+slotCopy(SharedSlot *dst, SharedSlot *src)
+{
+	atomic_store_explicit(&dst->key, atomic_load_explicit(&src->key, relaxed), relaxed);
+	atomic_store_explicit(&dst->len, atomic_load_explicit(&src->len, relaxed), relaxed);
+	atomic_store_explicit(&dst->data, atomic_load_explicit(&src->data, relaxed), relaxed);
+	atomic_store_explicit(&dst->hash, atomic_load_explicit(&src->hash, relaxed), relaxed);
+}
+
+static inline void
+slotStore(SharedSlot *s, uint64_t hash, void *key, uint64_t len, void *data)
+{
+	atomic_store_explicit(&s->key, key, relaxed);
+	atomic_store_explicit(&s->len, len, relaxed);
+	atomic_store_explicit(&s->data, data, relaxed);
+	atomic_store_explicit(&s->hash, hash, relaxed);
+}
+
+static inline SharedSlot *
+freeSlot(SharedBucket *b)
+{
+	int i;
+	for (i = 0; i < SHARED_WAYS; i++) {
+		if (atomic_load_explicit(&b->slot[i].hash, relaxed) == 0) {
+			return b->slot + i;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Only for writers holding the bucket's stripe.
+ */
+static SharedSlot *
+findLocked(SharedBucket *b, uint64_t hash, void *key, uint64_t len)
+{
+	int i;
+	for (i = 0; i < SHARED_WAYS; i++) {
+		SharedSlot *s = b->slot + i;
+		if (atomic_load_explicit(&s->hash, relaxed) == hash &&
+		    atomic_load_explicit(&s->len, relaxed) == len &&
+		    memcmp(atomic_load_explicit(&s->key, relaxed), key, len) == 0) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+static SharedArray *
+arrayAlloc(uint64_t numBuckets)
+{
+	uint64_t size = sizeof(SharedArray) + numBuckets * sizeof(SharedBucket);
+	SharedArray *a = aligned_alloc(64, size);
+	if (a == NULL) {
+		return NULL;
+	}
+	memset(a, 0, size);
+	a->numBuckets = numBuckets;
+	return a;
+}
+
+/*
+ * Place an element into an array no reader can see yet.
+ *
+ * 0 success
+ * 1 gave up
+ */
+static int
+arrayPlace(SharedArray *a, SharedSlot *e, uint64_t *rng)
+{
+	SharedSlot cur, victim;
+	uint64_t b = atomic_load_explicit(&e->hash, relaxed) & (a->numBuckets - 1);
+	int kicks;
+
+	slotCopy(&cur, e);
+	for (kicks = 0; kicks < CUCKOO_MAX_KICKS; kicks++) {
+		uint64_t hash = atomic_load_explicit(&cur.hash, relaxed);
+		uint64_t other = otherBucket(a, b, hash);
+		SharedSlot *s = freeSlot(a->buckets + b);
+		if (s == NULL) {
+			s = freeSlot(a->buckets + other);
+		}
+		if (s != NULL) {
+			slotCopy(s, &cur);
+			return 0;
+		}
+
+		*rng ^= *rng << 13;
+		*rng ^= *rng >> 7;
+		*rng ^= *rng << 17;
+		s = a->buckets[other].slot + *rng % SHARED_WAYS;
+		slotCopy(&victim, s);
+		slotCopy(s, &cur);
+		slotCopy(&cur, &victim);
+		b = otherBucket(a, other, atomic_load_explicit(&cur.hash, relaxed));
+	}
+
+	return 1;
+}
+
+/*
+ * Grow the table, unless someone else already has since 'seen' was read.
+ *
+ * Writers are kept out while the elements are copied, but the stripes are
+ * left alone, so lookups keep going on the old array until the new one is
+ * in place.
+ */
+static int
+sharedResize(SharedTable *t, SharedArray *seen)
+{
+	uint64_t rng = 0x9e3779b97f4a7c15ULL;
+	uint64_t s, i;
+	int w;
+
+	while (atomic_exchange_explicit(&t->resizing, 1, memory_order_acquire)) {
+		while (atomic_load_explicit(&t->resizing, relaxed)) {
+			cpuRelax();
+		}
+	}
+	atomic_thread_fence(memory_order_seq_cst);
+
+	SharedArray *a = atomic_load_explicit(&t->array, relaxed);
+	if (a != seen) {
+		goto DONE;
+	}
+
+	for (s = 0; s < SHARED_STRIPES; s++) {
+		while (atomic_load_explicit(&t->stripes[s].version, memory_order_acquire) & 1) {
+			cpuRelax();
+		}
+	}
+
+	uint64_t numBuckets = a->numBuckets * 2;
+	SharedArray *next;
+	for (;;) {
+		debug("Resize to %" PRIu64 " buckets\n", numBuckets);
+
+		next = arrayAlloc(numBuckets);
+		if (next == NULL) {
+			fprintf(stderr, "Can't allocate %" PRIu64 " buckets\n", numBuckets);
+			atomic_store_explicit(&t->resizing, 0, memory_order_release);
+			return -1;
+		}
+
+		for (i = 0; i < a->numBuckets; i++) {
+			for (w = 0; w < SHARED_WAYS; w++) {
+				SharedSlot *e = a->buckets[i].slot + w;
+				if (atomic_load_explicit(&e->hash, relaxed) == 0) {
+					continue;
+				}
+				if (arrayPlace(next, e, &rng) != 0) {
+					goto RETRY;
+				}
+			}
+		}
+		break;
+
+RETRY:
+		free(next);
+		numBuckets *= 2;
+	}
+
+	next->retired = a;
+	atomic_store_explicit(&t->array, next, memory_order_release);
+
+DONE:
+	atomic_store_explicit(&t->resizing, 0, memory_order_release);
+	return 0;
+}
+
+typedef struct PathNode {
+	uint64_t bucket;
+
+	/*
+	 * The node the element moves in from, and which of that node's slots
+	 * it's in.
+	 */
+	int parent;
+	int slot;
+} PathNode;
+
+/*
+ * Search breadth first, without locks, for the shortest chain of moves that
+ * frees a slot in bucket b[0] or b[1], then make the moves one at a time
+ * starting from the free end. Each move locks only the stripes of its two
+ * buckets and checks that nothing it relies on changed since the search;
+ * if something did, it stops and lets the caller try again.
+ *
+ * 0 moved elements
+ * 1 there's no path, the table needs to grow
+ * 2 lost a race
+ */
+static int
+makeRoom(SharedTable *t, SharedArray *a, uint64_t b[2])
+{
+	PathNode queue[MAX_SEARCH];
+	int head, tail = 0, end = -1;
+
+	queue[tail++] = (PathNode){b[0], -1, -1};
+	queue[tail++] = (PathNode){b[1], -1, -1};
+
+	for (head = 0; head < tail && end < 0; head++) {
+		SharedBucket *bucket = a->buckets + queue[head].bucket;
+		if (freeSlot(bucket) != NULL) {
+			end = head;
+			break;
+		}
+
+		int w;
+		for (w = 0; w < SHARED_WAYS && tail < MAX_SEARCH; w++) {
+			uint64_t hash = atomic_load_explicit(&bucket->slot[w].hash, relaxed);
+			if (hash == 0) {
+				continue;
+			}
+			queue[tail++] = (PathNode){otherBucket(a, queue[head].bucket, hash), head, w};
+		}
+	}
+	if (end < 0) {
+		debug("No free slot within %d buckets\n", MAX_SEARCH);
+		return 1;
+	}
+
+	while (queue[end].parent >= 0) {
+		uint64_t from = queue[queue[end].parent].bucket;
+		uint64_t to = queue[end].bucket;
+		int moved = 0;
+
+		writeLock(t, stripeOf(from), stripeOf(to));
+		if (atomic_load_explicit(&t->array, relaxed) == a) {
+			SharedSlot *src = a->buckets[from].slot + queue[end].slot;
+			uint64_t hash = atomic_load_explicit(&src->hash, relaxed);
+			SharedSlot *dst = freeSlot(a->buckets + to);
+
+			if (hash != 0 && otherBucket(a, from, hash) == to && dst != NULL) {
+				slotCopy(dst, src);
+				atomic_store_explicit(&src->hash, 0, relaxed);
+				moved = 1;
+			}
+		}
+		unlockPair(t, stripeOf(from), stripeOf(to));
+
+		if (!moved) {
+			return 2;
+		}
+		end = queue[end].parent;
+	}
+
+	return 0;
+}
+
+SharedTable *
+sharedAlloc(uint64_t initialSize, CuckooDeleteCallback deleteCallback)
+{
+	SharedTable *t;
+	uint64_t numBuckets = SHARED_STRIPES;
+
+	while (numBuckets * SHARED_WAYS < initialSize) {
+		numBuckets *= 2;
+	}
+
+	t = aligned_alloc(64, sizeof(*t));
+	if (t == NULL) {
+		return NULL;
+	}
+	memset(t, 0, sizeof(*t));
+
+	SharedArray *a = arrayAlloc(numBuckets);
+	if (a == NULL) {
+		free(t);
+		return NULL;
+	}
+	atomic_init(&t->array, a);
+	atomic_init(&t->resizing, 0);
+	atomic_init(&t->count, 0);
+	t->seed = 0x5eed;
+	t->deleteCallback = deleteCallback;
+
+	return t;
+}
+
+int
+sharedInsert(SharedTable *t, void *key, uint64_t len, void *data)
+{
+	uint64_t hash = keyHash(t, key, len);
+	uint64_t s0 = stripeOf(hash);
+	uint64_t s1 = cuckooAltBucket(hash, hash >> 32, SHARED_STRIPES);
+	int attempts = 0;
+
+	for (;;) {
+		uint64_t b[2];
+
+		writeLock(t, s0, s1);
+
+		/*
+		 * The array can't change while a writer holds any stripe.
+		 */
+		SharedArray *a = atomic_load_explicit(&t->array, relaxed);
+		b[0] = hash & (a->numBuckets - 1);
+		b[1] = otherBucket(a, b[0], hash);
+
+		if (findLocked(a->buckets + b[0], hash, key, len) ||
+		    findLocked(a->buckets + b[1], hash, key, len)) {
+			unlockPair(t, s0, s1);
+			return 0;
+		}
+
+		SharedSlot *s = freeSlot(a->buckets + b[0]);
+		if (s == NULL) {
+			s = freeSlot(a->buckets + b[1]);
+		}
+		if (s != NULL) {
+			slotStore(s, hash, key, len, data);
+			atomic_fetch_add_explicit(&t->count, 1, relaxed);
+			unlockPair(t, s0, s1);
+			return 0;
+		}
+		unlockPair(t, s0, s1);
+
+		/*
+		 * Another writer may take the slot that was made before the insert
+		 * gets back to it. That's progress for the table, so only races
+		 * lost while moving elements count towards growing it.
+		 */
+		int ret = makeRoom(t, a, b);
+		if (ret == 0) {
+			attempts = 0;
+		} else if (ret == 1 || ++attempts >= MAX_ATTEMPTS) {
+			if (sharedResize(t, a) != 0) {
+				return -1;
+			}
+			attempts = 0;
+		}
+	}
+}
+
+int
+sharedLookup(SharedTable *t, void *key, uint64_t len, void **data)
+{
+	uint64_t hash = keyHash(t, key, len);
+	uint64_t s0 = stripeOf(hash);
+	uint64_t s1 = cuckooAltBucket(hash, hash >> 32, SHARED_STRIPES);
+	atomic_uint_fast64_t *v0 = &t->stripes[s0].version;
+	atomic_uint_fast64_t *v1 = &t->stripes[s1].version;
+
+	struct {
+		void *key;
+		uint64_t len;
+		void *data;
+	} found[2 * SHARED_WAYS];
+	int n, i;
+
+	for (;;) {
+		uint_fast64_t before0 = atomic_load_explicit(v0, memory_order_acquire);
+		uint_fast64_t before1 = atomic_load_explicit(v1, memory_order_acquire);
+		if ((before0 | before1) & 1) {
+			cpuRelax();
+			continue;
+		}
+
+		SharedArray *a = atomic_load_explicit(&t->array, memory_order_acquire);
+		uint64_t b[2];
+		b[0] = hash & (a->numBuckets - 1);
+		b[1] = otherBucket(a, b[0], hash);
+
+		n = 0;
+		for (i = 0; i < 2 * SHARED_WAYS; i++) {
+			SharedSlot *s = a->buckets[b[i / SHARED_WAYS]].slot + i % SHARED_WAYS;
+			if (atomic_load_explicit(&s->hash, relaxed) == hash) {
+				found[n].key = atomic_load_explicit(&s->key, relaxed);
+				found[n].len = atomic_load_explicit(&s->len, relaxed);
+				found[n].data = atomic_load_explicit(&s->data, relaxed);
+				n++;
+			}
+		}
+
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(v0, relaxed) == before0 &&
+		    atomic_load_explicit(v1, relaxed) == before1) {
+			break;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (found[i].len == len && memcmp(found[i].key, key, len) == 0) {
+			if (data) {
+				*data = found[i].data;
+			}
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void *
+sharedDelete(SharedTable *t, void *key, uint64_t len, CuckooDeleteCallback deleteCallback)
+{
+	uint64_t hash = keyHash(t, key, len);
+	uint64_t s0 = stripeOf(hash);
+	uint64_t s1 = cuckooAltBucket(hash, hash >> 32, SHARED_STRIPES);
+	void *data = NULL;
+
+	writeLock(t, s0, s1);
+
+	SharedArray *a = atomic_load_explicit(&t->array, relaxed);
+	uint64_t b = hash & (a->numBuckets - 1);
+	SharedSlot *s = findLocked(a->buckets + b, hash, key, len);
+	if (s == NULL) {
+		s = findLocked(a->buckets + otherBucket(a, b, hash), hash, key, len);
+	}
+	if (s != NULL) {
+		CuckooElement e = {
+			atomic_load_explicit(&s->key, relaxed),
+			len,
+			atomic_load_explicit(&s->data, relaxed)
+		};
+		atomic_store_explicit(&s->hash, 0, relaxed);
+		atomic_fetch_sub_explicit(&t->count, 1, relaxed);
+		data = e.data;
+		if (deleteCallback) {
+			deleteCallback(&e);
+		}
+	}
+
+	unlockPair(t, s0, s1);
+
+	return data;
+}
+
+uint64_t
+sharedCount(SharedTable *t)
+{
+	return atomic_load_explicit(&t->count, relaxed);
+}
+
+void
+sharedFree(SharedTable **t)
+{
+	if (t == NULL || *t == NULL) {
+		return;
+	}
+
+	SharedArray *a = atomic_load(&(*t)->array);
+	uint64_t i;
+	int w;
+
+	for (i = 0; i < a->numBuckets; i++) {
+		for (w = 0; w < SHARED_WAYS; w++) {
+			SharedSlot *s = a->buckets[i].slot + w;
+			if (atomic_load(&s->hash) == 0 || (*t)->deleteCallback == NULL) {
+				continue;
+			}
+			CuckooElement e = {atomic_load(&s->key), atomic_load(&s->len), atomic_load(&s->data)};
+			(*t)->deleteCallback(&e);
+		}
+	}
+
+	while (a != NULL) {
+		SharedArray *retired = a->retired;
+		free(a);
+		a = retired;
+	}
+	free(*t);
+	*t = NULL;
+}
@@ -0,0 +1,104 @@
+#ifndef __SHARED_H
+#define __SHARED_H
+
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include "cuckoo.h"
+
+/*
+ * A cuckoo table that many threads can use at once.
+ *
+ * Buckets hold SHARED_WAYS slots and are covered by SHARED_STRIPES locks,
+ * bucket i by stripe i % SHARED_STRIPES. Each stripe's lock is also a
+ * version counter: it's odd while a writer holds it and goes up by two for
+ * every write. Writers lock only the stripes of the two buckets they change,
+ * one pair at a time while shifting elements along an eviction path.
+ *
+ * Readers take no locks and write nothing. They note the versions of their
+ * key's two stripes, copy out any slot whose stored hash matches, and retry
+ * if either version moved in the meantime (a seqlock). Keys are only
+ * compared once the copy is known to be consistent.
+ *
+ * Growing the table doesn't touch the stripes. It raises the resizing flag,
+ * which keeps writers out, waits for the writes in flight, and copies the
+ * elements to a new array while readers carry on with the old one, which
+ * isn't changing. Readers might still be looking at the old slot array after
+ * the new one is in place, so it's kept until the table is freed; all of
+ * them together are never bigger than the current array.
+ *
+ * A reader can compare against a key right after another thread deletes
+ * it, so keys must stay readable until no lookups can be running.
+ */
+
+#define SHARED_WAYS 4
+#define SHARED_STRIPES 1024
+
+typedef struct SharedSlot {
+	/*
+	 * The key's hash, or 0 for an empty slot.
+	 */
+	atomic_uint_fast64_t hash;
+	_Atomic(void *) key;
+	atomic_uint_fast64_t len;
+	_Atomic(void *) data;
+} SharedSlot;
+
+typedef struct SharedBucket {
+	SharedSlot slot[SHARED_WAYS];
+} SharedBucket;
+
+typedef struct SharedArray {
+	uint64_t numBuckets;
+	struct SharedArray *retired;
+	_Alignas(64) SharedBucket buckets[];
+} SharedArray;
+
+typedef struct SharedStripe {
+	_Alignas(64) atomic_uint_fast64_t version;
+} SharedStripe;
+
+typedef struct SharedTable {
+	SharedStripe stripes[SHARED_STRIPES];
+	_Atomic(SharedArray *) array;
+	atomic_int resizing;
+	uint64_t seed;
+	CuckooDeleteCallback deleteCallback;
+	_Alignas(64) atomic_uint_fast64_t count;
+} SharedTable;
+
+/*
+ * 'initialSize' is the number of slots. There's always at least one bucket
+ * per stripe.
+ *
+ * On success, a pointer to the new table is returned.
+ * On error, NULL is returned.
+ */
+SharedTable *sharedAlloc(uint64_t initialSize, CuckooDeleteCallback deleteCallback);
+
+/*
+ * 0 success, or the key was already in the table
+ * -1 error
+ */
+int sharedInsert(SharedTable *t, void *key, uint64_t len, void *data);
+
+/*
+ * 1 found, and '*data' is set if 'data' isn't NULL
+ * 0 not found
+ */
+int sharedLookup(SharedTable *t, void *key, uint64_t len, void **data);
+
+/*
+ * Returns the data of the removed element, or NULL if the key isn't in the
+ * table.
+ */
+void *sharedDelete(SharedTable *t, void *key, uint64_t len, CuckooDeleteCallback deleteCallback);
+
+uint64_t sharedCount(SharedTable *t);
+
+/*
+ * No other thread may be using the table.
+ */
+void sharedFree(SharedTable **t);
+
+#endif /* __SHARED_H */
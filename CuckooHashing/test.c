@@ -1,8 +1,804 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "cuckoo.h"
+#include "bucket.h"
+#include "shared.h"
+#include "filter.h"
+
+/*
+ * Both outputs of cuckooFastHash depend on the whole key and the seed, and
+ * a table still works with the old polynomial hash swapped in.
+ */
+static void
+testHash(char **strings, int n)
+{
+	uint8_t key[40] = {0};
+	uint64_t a[2], b[2];
+	int i;
+
+	cuckooFastHash(key, sizeof(key), 1, a);
+	if (a[0] == a[1]) {
+		abort();
+	}
+	cuckooFastHash(key, sizeof(key), 2, b);
+	if (a[0] == b[0] || a[1] == b[1]) {
+		abort();
+	}
+	key[sizeof(key) - 1] = 1;
+	cuckooFastHash(key, sizeof(key), 1, b);
+	if (a[0] == b[0] || a[1] == b[1]) {
+		abort();
+	}
+
+	CuckooTable *t = cuckooAlloc(5, NULL);
+	if (t->size != 8 || cuckooSetHash(t, cuckooPolyHash, 7) != 0) {
+		abort();
+	}
+	for (i = 0; i < n; i++) {
+		cuckooInsert(t, strings[i], strlen(strings[i]), strings[i]);
+	}
+	if (t->count != n || cuckooSetHash(t, cuckooFastHash, 0) != -1) {
+		abort();
+	}
+	for (i = 0; i < n; i++) {
+		CuckooElement *e = cuckooLookup(t, strings[i], strlen(strings[i]));
+		if (e == NULL || e->data != strings[i]) {
+			printf("Can't find with polyHash: %s\n", strings[i]);
+			abort();
+		}
+	}
+	cuckooFree(&t);
+}
+
+/*
+ * Fill a CuckooTable until it has to grow. It should get close to the 50%
+ * a one slot per bucket table can reach, using the stash on the way, and
+ * nothing should be lost when stashed elements are deleted or the table
+ * grows.
+ */
+static void
+testStash(void)
+{
+	uint64_t n = 4096;
+	uint64_t *keys = malloc(n * sizeof(*keys));
+	CuckooTable *t = cuckooAlloc(1024, NULL);
+	uint64_t i, stashed = 0;
+
+	for (i = 0; i < n; i++) {
+		keys[i] = i * 0x9e3779b97f4a7c15ULL;
+	}
+	for (i = 0; t->size == 1024; i++) {
+		if (t->stashCount > 0) {
+			stashed++;
+		}
+		cuckooInsert(t, keys + i, sizeof(*keys), keys + i);
+	}
+	if (stashed == 0 || i - 1 < 1024 * 45 / 100) {
+		printf("CuckooTable grew after %" PRIu64 " inserts\n", i - 1);
+		abort();
+	}
+	printf("CuckooTable: 1024 slots held %" PRIu64 " keys before growing\n", i - 1);
+
+	uint64_t inserted = i;
+	for (; i < n; i++) {
+		cuckooInsert(t, keys + i, sizeof(*keys), keys + i);
+		if (t->stashCount > 0) {
+			/*
+			 * Delete a stashed element.
+			 */
+			uint64_t *k = t->stash[0].e.key;
+			if (cuckooDelete(t, k, sizeof(*k), NULL) != k ||
+			    cuckooLookup(t, k, sizeof(*k)) != NULL) {
+				abort();
+			}
+			cuckooInsert(t, k, sizeof(*k), k);
+		}
+	}
+	if (t->count != n) {
+		abort();
+	}
+
+	for (i = 0; i < inserted; i += 2) {
+		cuckooDelete(t, keys + i, sizeof(*keys), NULL);
+	}
+	for (i = 0; i < n; i++) {
+		CuckooElement *e = cuckooLookup(t, keys + i, sizeof(*keys));
+		if ((e == NULL) != (i < inserted && i % 2 == 0)) {
+			abort();
+		}
+		if (e != NULL && e->data != keys + i) {
+			abort();
+		}
+	}
+
+	cuckooFree(&t);
+	free(keys);
+}
+
+/*
+ * Every key must stay reachable while a growing CuckooTable moves elements
+ * from its old array, including across deletes, and the old array must go
+ * away once it's empty.
+ */
+static void
+testGrow(void)
+{
+	uint64_t n = 20000;
+	uint64_t *keys = malloc(4 * n * sizeof(*keys));
+	CuckooTable *t = cuckooAlloc(4, NULL);
+	uint64_t i, j, growing = 0;
+
+	/*
+	 * Stop in the middle of growing.
+	 */
+	for (i = 0; i < n || t->oldTable == NULL; i++) {
+		keys[i] = i * 0x9e3779b97f4a7c15ULL;
+		cuckooInsert(t, keys + i, sizeof(*keys), keys + i);
+
+		if (t->oldTable == NULL) {
+			continue;
+		}
+		growing++;
+
+		/*
+		 * Delete and put back an element that may not have moved yet.
+		 */
+		j = (i * 7) / 11;
+		if (cuckooDelete(t, keys + j, sizeof(*keys), NULL) != keys + j) {
+			abort();
+		}
+		cuckooInsert(t, keys + j, sizeof(*keys), keys + j);
+
+		if (i % 97 == 0) {
+			for (j = 0; j <= i; j++) {
+				CuckooElement *e = cuckooLookup(t, keys + j, sizeof(*keys));
+				if (e == NULL || e->data != keys + j) {
+					printf("Lost key %" PRIu64 " while growing\n", j);
+					abort();
+				}
+			}
+		}
+	}
+	n = i;
+	if (growing == 0 || t->count != n) {
+		abort();
+	}
+
+	/*
+	 * Inserting what's already there still moves the old array along.
+	 */
+	for (i = 0; t->oldTable != NULL; i++) {
+		cuckooInsert(t, keys, sizeof(*keys), keys);
+	}
+	for (i = 0; i < n; i++) {
+		if (cuckooLookup(t, keys + i, sizeof(*keys)) == NULL) {
+			abort();
+		}
+	}
+
+	cuckooFree(&t);
+	free(keys);
+}
+
+/*
+ * cuckooLookupBatch must agree with cuckooLookup key for key, for batches
+ * that don't divide evenly, keys that are missing, both kinds of table, and
+ * a table stopped in the middle of growing.
+ */
+static void
+testBatch(int inlineKeys)
+{
+	uint64_t n = 3000, m = 16 * n;
+	uint64_t *keys = malloc(m * sizeof(*keys));
+	void **ptrs = malloc(m * sizeof(*ptrs));
+	uint64_t *lens = malloc(m * sizeof(*lens));
+	CuckooElement **out = malloc(m * sizeof(*out));
+	CuckooTable *t = cuckooAlloc(4, NULL);
+	uint64_t i;
+
+	if (inlineKeys) {
+		cuckooSetInlineKeys(t);
+	}
+	for (i = 0; i < m; i++) {
+		keys[i] = i * 0x9e3779b97f4a7c15ULL;
+		ptrs[i] = keys + i;
+		lens[i] = sizeof(*keys);
+	}
+	for (i = 0; i < n || t->oldTable == NULL; i++) {
+		if (2 * i >= m) {
+			abort();
+		}
+		cuckooInsert(t, keys + 2 * i, sizeof(*keys), keys + 2 * i);
+	}
+	n = i;
+	m = 2 * n + 5;
+
+	if (cuckooLookupBatch(t, ptrs, lens, m, out) != n) {
+		abort();
+	}
+	for (i = 0; i < m; i++) {
+		if (out[i] != cuckooLookup(t, keys + i, sizeof(*keys)) ||
+		    (out[i] != NULL) != (i % 2 == 0 && i / 2 < n)) {
+			abort();
+		}
+	}
+
+	cuckooFree(&t);
+	free(out);
+	free(lens);
+	free(ptrs);
+	free(keys);
+}
+
+/*
+ * A built table must hold every key in the one array it was allocated with,
+ * and carry on working as an ordinary table.
+ */
+static void
+testBuild(int inlineKeys)
+{
+	uint64_t n = 100000, i;
+	char **strings = malloc(n * sizeof(*strings));
+	void **keys = malloc(n * sizeof(*keys));
+	uint64_t *lens = malloc(n * sizeof(*lens));
+	char buf[64];
+	CuckooStats stats;
+
+	for (i = 0; i < n; i++) {
+		snprintf(buf, sizeof(buf), i % 3 ? "k%" PRIu64 : "a-much-longer-key-%" PRIu64 "-than-fits", i);
+		strings[i] = strdup(buf);
+		keys[i] = strings[i];
+		lens[i] = strlen(strings[i]);
+	}
+
+	CuckooTable *t = cuckooBuild(keys, lens, (void **)strings, n, 0.45, inlineKeys);
+	if (t == NULL || t->count != n || t->size != 262144 || t->inlineKeys != inlineKeys) {
+		abort();
+	}
+	for (i = 0; i < n; i++) {
+		CuckooElement *e = cuckooLookup(t, strings[i], lens[i]);
+		if (e == NULL || e->data != strings[i] || (inlineKeys && e->key == strings[i])) {
+			printf("Can't find built key %s\n", strings[i]);
+			abort();
+		}
+	}
+	if (cuckooLookup(t, "missing", 7) != NULL) {
+		abort();
+	}
+
+	cuckooInsert(t, "extra", 5, NULL);
+	cuckooDelete(t, strings[0], lens[0], NULL);
+	cuckooStats(t, &stats);
+	if (t->count != n || cuckooLookup(t, "extra", 5) == NULL || stats.grows != 0) {
+		abort();
+	}
+	cuckooFree(&t);
+
+	/*
+	 * Close to the limit it may need other seeds or more room, but it
+	 * still has to get there.
+	 */
+	t = cuckooBuild(keys, lens, NULL, 1000, 0.49, inlineKeys);
+	if (t == NULL) {
+		abort();
+	}
+	for (i = 0; i < 1000; i++) {
+		if (cuckooLookup(t, strings[i], lens[i]) == NULL) {
+			abort();
+		}
+	}
+	cuckooFree(&t);
+
+	t = cuckooBuild(NULL, NULL, NULL, 0, 0.4, inlineKeys);
+	if (t == NULL || t->count != 0 || t->size != 4) {
+		abort();
+	}
+	cuckooFree(&t);
+
+	/*
+	 * Two copies of a key can be placed, one in each of its slots, but
+	 * must be refused all the same. So must three, which can't be placed.
+	 */
+	keys[1] = keys[0];
+	lens[1] = lens[0];
+	if (cuckooBuild(keys, lens, NULL, 2, 0.4, inlineKeys) != NULL ||
+	    cuckooBuild(keys, lens, NULL, n, 0.4, inlineKeys) != NULL) {
+		abort();
+	}
+	keys[2] = keys[0];
+	lens[2] = lens[0];
+	if (cuckooBuild(keys, lens, NULL, 3, 0.4, inlineKeys) != NULL ||
+	    cuckooBuild(keys, lens, NULL, n, 0.4, inlineKeys) != NULL) {
+		abort();
+	}
+
+	for (i = 0; i < n; i++) {
+		free(strings[i]);
+	}
+	free(lens);
+	free(keys);
+	free(strings);
+}
+
+/*
+ * The statistics must account for every placement and lookup.
+ */
+static void
+testStats(void)
+{
+	uint64_t n = 20000;
+	uint64_t *keys = malloc(2 * n * sizeof(*keys));
+	CuckooTable *t = cuckooAlloc(4, NULL);
+	CuckooStats stats;
+	uint64_t i, sum;
+
+	for (i = 0; i < 2 * n; i++) {
+		keys[i] = i * 0x9e3779b97f4a7c15ULL;
+	}
+	for (i = 0; i < n; i++) {
+		cuckooInsert(t, keys + i, sizeof(*keys), NULL);
+	}
+
+	cuckooStats(t, &stats);
+	for (i = 0, sum = stats.stashed; i < CUCKOO_KICK_BUCKETS; i++) {
+		sum += stats.kicks[i];
+	}
+	if (stats.count != n || stats.loadFactor <= 0 || stats.loadFactor > 1 ||
+	    sum < n || stats.kicks[0] == 0 || stats.kicks[0] == sum ||
+	    stats.grows == 0 || stats.resizeNanos == 0 ||
+	    stats.lookups != n || stats.found != 0) {
+		abort();
+	}
+#ifdef CUCKOO_LATENCY
+	for (i = 0, sum = 0; i < CUCKOO_LATENCY_BUCKETS; i++) {
+		sum += stats.insertLatency[i];
+	}
+	if (sum != n) {
+		abort();
+	}
+#endif
+
+	cuckooResetStats(t);
+	for (i = 0; i < 2 * n; i++) {
+		cuckooLookup(t, keys + i, sizeof(*keys));
+	}
+	cuckooStats(t, &stats);
+	for (i = 0, sum = 0; i <= CUCKOO_MAX_PROBES; i++) {
+		sum += stats.probes[i];
+	}
+	if (stats.lookups != 2 * n || stats.found != n || sum != 2 * n ||
+	    stats.probes[0] != 0 || stats.probes[1] == 0 || stats.grows != 0) {
+		abort();
+	}
+
+	cuckooFree(&t);
+	free(keys);
+}
+
+static uint64_t
+testValueLength(CuckooElement *e)
+{
+	return strlen(e->data) + 1;
+}
+
+/*
+ * Save a table and serve it from the mapped image: every key and value
+ * must come back, the image must be read-only, and a damaged image must be
+ * caught. The inline key table is saved with elements in its stash and
+ * its values copied into the image, the other one while it's still
+ * growing and with its data saved as plain integers.
+ */
+static void
+testImage(int inlineKeys)
+{
+	char path[64], buf[64];
+	uint64_t n, i;
+	char **keys = malloc(100000 * sizeof(*keys));
+	char **values = malloc(100000 * sizeof(*values));
+	CuckooTable *t = cuckooAlloc(4, NULL);
+
+	snprintf(path, sizeof(path), "/tmp/cuckoo-test-%d.img", (int)getpid());
+	if (inlineKeys) {
+		cuckooSetInlineKeys(t);
+	}
+
+	for (i = 0; i < 1000 || (inlineKeys ? t->stashCount == 0 : t->oldTable == NULL); i++) {
+		if (i == 100000) {
+			abort();
+		}
+		snprintf(buf, sizeof(buf), i % 3 ? "k%" PRIu64 : "a-much-longer-key-%" PRIu64 "-than-fits", i);
+		keys[i] = strdup(buf);
+		snprintf(buf, sizeof(buf), "value-%" PRIu64, i);
+		values[i] = strdup(buf);
+		cuckooInsert(t, keys[i], strlen(keys[i]), inlineKeys ? values[i] : (void *)(uintptr_t)(i + 1));
+	}
+	n = i;
+
+	if (cuckooSave(t, path, inlineKeys ? testValueLength : NULL) != 0 || t->oldTable != NULL) {
+		abort();
+	}
+
+	CuckooTable *m = cuckooOpenMapped(path, NULL, 1);
+	if (m == NULL || m->count != t->count || m->size != t->size || m->stashCount != t->stashCount) {
+		abort();
+	}
+	for (i = 0; i < n; i++) {
+		CuckooElement *e = cuckooLookup(m, keys[i], strlen(keys[i]));
+		if (e == NULL || memcmp(cuckooKey(m, e), keys[i], e->len) != 0) {
+			printf("Can't find %s in the image\n", keys[i]);
+			abort();
+		}
+		if (inlineKeys ? strcmp(cuckooData(m, e), values[i]) != 0 :
+		                 cuckooData(m, e) != (void *)(uintptr_t)(i + 1)) {
+			abort();
+		}
+	}
+	uint64_t lens[2] = {strlen(keys[0]), 7};
+	CuckooElement *out[2];
+	void *batch[2] = {keys[0], "missing"};
+	if (cuckooLookupBatch(m, batch, lens, 2, out) != 1 || out[1] != NULL) {
+		abort();
+	}
+	if (cuckooInsert(m, "new", 3, NULL) != -1 || cuckooDelete(m, keys[0], lens[0], NULL) != NULL) {
+		abort();
+	}
+	cuckooFree(&m);
+
+	/*
+	 * Damage the last value or key.
+	 */
+	FILE *f = fopen(path, "r+");
+	fseek(f, -1, SEEK_END);
+	fputc(0x55, f);
+	fclose(f);
+	if (cuckooOpenMapped(path, NULL, 1) != NULL) {
+		abort();
+	}
+	m = cuckooOpenMapped(path, NULL, 0);
+	if (m == NULL) {
+		abort();
+	}
+	cuckooFree(&m);
+
+	/*
+	 * The header isn't checksummed, so its offsets are checked even when
+	 * the checksum isn't.
+	 */
+	CuckooImageHeader h;
+	f = fopen(path, "r+");
+	if (fread(&h, sizeof(h), 1, f) != 1) {
+		abort();
+	}
+	h.slotsOffset = (h.fileSize + 64) & ~63ULL;
+	rewind(f);
+	fwrite(&h, sizeof(h), 1, f);
+	fclose(f);
+	if (cuckooOpenMapped(path, NULL, 0) != NULL) {
+		abort();
+	}
+
+	f = fopen(path, "w");
+	fputs("not a table", f);
+	fclose(f);
+	if (cuckooOpenMapped(path, NULL, 0) != NULL) {
+		abort();
+	}
+	unlink(path);
+	if (cuckooOpenMapped(path, NULL, 0) != NULL) {
+		abort();
+	}
+
+	cuckooFree(&t);
+	for (i = 0; i < n; i++) {
+		free(keys[i]);
+		free(values[i]);
+	}
+	free(values);
+	free(keys);
+}
+
+/*
+ * A table with inline keys keeps its own copy of every key, short or long,
+ * so the caller's buffer can be reused right after each insert.
+ */
+static void
+testInline(void)
+{
+	uint64_t n = 5000;
+	CuckooTable *t = cuckooAlloc(4, NULL);
+	char buf[64];
+	uint64_t i;
+
+	if (cuckooSetInlineKeys(t) != 0) {
+		abort();
+	}
+
+	for (i = 0; i < n; i++) {
+		int len = snprintf(buf, sizeof(buf), i % 3 ? "k%" PRIu64 : "a-much-longer-key-%" PRIu64 "-than-fits", i);
+		cuckooInsert(t, buf, len, (void *)(uintptr_t)(i + 1));
+		memset(buf, 'x', sizeof(buf));
+	}
+	if (t->count != n || cuckooSetInlineKeys(t) != -1) {
+		abort();
+	}
+
+	for (i = 0; i < n; i += 2) {
+		int len = snprintf(buf, sizeof(buf), i % 3 ? "k%" PRIu64 : "a-much-longer-key-%" PRIu64 "-than-fits", i);
+		if (cuckooDelete(t, buf, len, NULL) != (void *)(uintptr_t)(i + 1)) {
+			abort();
+		}
+	}
+	for (i = 0; i < n; i++) {
+		int len = snprintf(buf, sizeof(buf), i % 3 ? "k%" PRIu64 : "a-much-longer-key-%" PRIu64 "-than-fits", i);
+		CuckooElement *e = cuckooLookup(t, buf, len);
+		if ((e == NULL) != (i % 2 == 0)) {
+			abort();
+		}
+		if (e != NULL && (e->key == (void *)buf || e->len != len || e->data != (void *)(uintptr_t)(i + 1))) {
+			abort();
+		}
+	}
+
+	cuckooFree(&t);
+}
+
+/*
+ * Fill a BucketTable that starts out with room for 'size' slots to 95%
+ * without letting it grow, then check every key is still there, nothing
+ * else is, and deletes work.
+ */
+static void
+testBucket(uint64_t size)
+{
+	BucketTable *t = bucketAlloc(size, NULL);
+	uint64_t slots = t->numBuckets * BUCKET_WAYS;
+	uint64_t n = slots * 95 / 100;
+	uint64_t *keys = malloc(n * sizeof(*keys));
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		keys[i] = i * 2654435761u;
+		if (bucketInsert(t, keys + i, sizeof(*keys), keys + i) != 0) {
+			printf("BucketTable grew at load %.3f\n", bucketLoadFactor(t));
+			abort();
+		}
+	}
+	if (t->numBuckets * BUCKET_WAYS != slots || t->count != n) {
+		abort();
+	}
+
+	for (i = 0; i < n; i++) {
+		CuckooElement *e = bucketLookup(t, keys + i, sizeof(*keys));
+		if (e == NULL || e->data != keys + i) {
+			printf("Can't find key %" PRIu64 "\n", keys[i]);
+			abort();
+		}
+	}
+
+	uint64_t missing = 1;
+	if (bucketLookup(t, &missing, sizeof(missing)) != NULL) {
+		abort();
+	}
+
+	for (i = 0; i < n; i += 2) {
+		if (bucketDelete(t, keys + i, sizeof(*keys), NULL) != keys + i) {
+			abort();
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if ((bucketLookup(t, keys + i, sizeof(*keys)) == NULL) != (i % 2 == 0)) {
+			abort();
+		}
+	}
+
+	/*
+	 * Grow past the starting size.
+	 */
+	for (i = 0; i < n; i++) {
+		bucketInsert(t, keys + i, sizeof(*keys), keys + i);
+	}
+	uint64_t more = 2 * slots;
+	uint64_t *extra = malloc(more * sizeof(*extra));
+	for (i = 0; i < more; i++) {
+		extra[i] = ~i;
+		bucketInsert(t, extra + i, sizeof(*extra), NULL);
+	}
+	if (t->count != n + more) {
+		abort();
+	}
+	for (i = 0; i < more; i++) {
+		if (bucketLookup(t, extra + i, sizeof(*extra)) == NULL) {
+			abort();
+		}
+	}
+
+	printf("BucketTable: %" PRIu64 " slots, held %" PRIu64 " keys (%.1f%%) without growing\n",
+	       slots, n, 100.0 * n / slots);
+
+	bucketFree(&t);
+	free(extra);
+	free(keys);
+}
+
+/*
+ * Fill a filter to 95% of its slots. Every inserted key must
+ * be found, keys that were never inserted mostly shouldn't be, and deleted
+ * keys go away without taking the others with them.
+ */
+static void
+testFilter(int fpBits)
+{
+	CuckooFilter *f = filterAlloc(100000, fpBits);
+	uint64_t n = f->numBuckets * FILTER_WAYS * 95 / 100;
+	uint64_t i, key, hits = 0;
+
+	for (i = 0; i < n; i++) {
+		key = i;
+		if (filterInsert(f, &key, sizeof(key)) != 0) {
+			printf("CuckooFilter full at load %.3f\n", filterLoadFactor(f));
+			abort();
+		}
+	}
+	for (i = 0; i < n; i++) {
+		key = i;
+		if (!filterContains(f, &key, sizeof(key))) {
+			abort();
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		key = n + i;
+		hits += filterContains(f, &key, sizeof(key));
+	}
+	double rate = (double)hits / n;
+	double load = filterLoadFactor(f);
+	if (rate > 4.0 * FILTER_WAYS / (1 << fpBits)) {
+		abort();
+	}
+
+	for (i = 0; i < n; i += 2) {
+		key = i;
+		if (filterDelete(f, &key, sizeof(key)) != 0) {
+			abort();
+		}
+	}
+	for (i = 1; i < n; i += 2) {
+		key = i;
+		if (!filterContains(f, &key, sizeof(key))) {
+			abort();
+		}
+	}
+	if (f->count != n / 2) {
+		abort();
+	}
+
+	printf("CuckooFilter: %d bit fingerprints, load %.3f, %.4f%% false positives\n",
+	       fpBits, load, 100 * rate);
+
+	filterFree(&f);
+}
+
+#define SHARED_THREADS 4
+#define SHARED_STABLE 10000
+#define SHARED_PER_WRITER 50000
+
+typedef struct SharedTest {
+	SharedTable *t;
+	uint64_t *keys;
+	int id;
+	atomic_int *writersLeft;
+	atomic_int *errors;
+} SharedTest;
+
+/*
+ * Insert this writer's own keys, growing the table several times, then
+ * delete every other one.
+ */
+static void *
+sharedWriter(void *arg)
+{
+	SharedTest *st = arg;
+	uint64_t *keys = st->keys + SHARED_STABLE + st->id * SHARED_PER_WRITER;
+	uint64_t i;
+
+	for (i = 0; i < SHARED_PER_WRITER; i++) {
+		if (sharedInsert(st->t, keys + i, sizeof(*keys), keys + i) != 0) {
+			atomic_fetch_add(st->errors, 1);
+		}
+	}
+	for (i = 0; i < SHARED_PER_WRITER; i += 2) {
+		if (sharedDelete(st->t, keys + i, sizeof(*keys), NULL) != keys + i) {
+			atomic_fetch_add(st->errors, 1);
+		}
+	}
+
+	atomic_fetch_sub(st->writersLeft, 1);
+	return NULL;
+}
+
+/*
+ * The stable keys are never touched by the writers, so every lookup must
+ * find them no matter what the writers are moving around.
+ */
+static void *
+sharedReader(void *arg)
+{
+	SharedTest *st = arg;
+	uint64_t i = st->id;
+	uint64_t missing = ~0ULL;
+
+	while (atomic_load(st->writersLeft) > 0) {
+		void *data = NULL;
+		uint64_t *k = st->keys + i % SHARED_STABLE;
+
+		if (!sharedLookup(st->t, k, sizeof(*k), &data) || data != k) {
+			atomic_fetch_add(st->errors, 1);
+		}
+		if (sharedLookup(st->t, &missing, sizeof(missing), NULL)) {
+			atomic_fetch_add(st->errors, 1);
+		}
+		i += 7919;
+	}
+
+	return NULL;
+}
+
+static void
+testShared(void)
+{
+	uint64_t n = SHARED_STABLE + (SHARED_THREADS / 2) * SHARED_PER_WRITER;
+	uint64_t *keys = malloc(n * sizeof(*keys));
+	SharedTable *t = sharedAlloc(0, NULL);
+	pthread_t threads[SHARED_THREADS];
+	SharedTest st[SHARED_THREADS];
+	atomic_int writersLeft = SHARED_THREADS / 2;
+	atomic_int errors = 0;
+	uint64_t i;
+	int j;
+
+	for (i = 0; i < n; i++) {
+		keys[i] = i * 0x9e3779b97f4a7c15ULL;
+	}
+	for (i = 0; i < SHARED_STABLE; i++) {
+		sharedInsert(t, keys + i, sizeof(*keys), keys + i);
+	}
+	SharedArray *first = atomic_load(&t->array);
+
+	for (j = 0; j < SHARED_THREADS; j++) {
+		st[j] = (SharedTest){t, keys, j / 2, &writersLeft, &errors};
+		pthread_create(threads + j, NULL, j % 2 ? sharedReader : sharedWriter, st + j);
+	}
+	for (j = 0; j < SHARED_THREADS; j++) {
+		pthread_join(threads[j], NULL);
+	}
+
+	if (atomic_load(&errors) != 0 || atomic_load(&t->array) == first) {
+		printf("SharedTable: %d errors\n", atomic_load(&errors));
+		abort();
+	}
+
+	for (i = 0; i < n; i++) {
+		void *data = NULL;
+		int deleted = i >= SHARED_STABLE && (i - SHARED_STABLE) % SHARED_PER_WRITER % 2 == 0;
+		if (sharedLookup(t, keys + i, sizeof(*keys), &data) == deleted) {
+			abort();
+		}
+		if (!deleted && data != keys + i) {
+			abort();
+		}
+	}
+	if (sharedCount(t) != SHARED_STABLE + (SHARED_THREADS / 2) * SHARED_PER_WRITER / 2) {
+		abort();
+	}
+
+	sharedFree(&t);
+	free(keys);
+}
 
 int main()
 {
@@ -35,5 +831,25 @@ int main()
 
 	cuckooFree(&t);
 
+	testHash(strings, n);
+	testStash();
+	testGrow();
+	testInline();
+	testBatch(0);
+	testBatch(1);
+	testImage(0);
+	testImage(1);
+	testStats();
+	testBuild(0);
+	testBuild(1);
+	testShared();
+	if (filterAlloc(100, 3) != NULL || filterAlloc(100, 17) != NULL) {
+		abort();
+	}
+	testFilter(8);
+	testFilter(12);
+	testBucket(1000);
+	testBucket(1 << 20);
+
 	return 0;
 }